@@ -0,0 +1,63 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**************************************************************************/
+#include <sys/mman.h>
+#include <unistd.h>
+#include <system_error>
+#include <cerrno>
+#include "ring_buffer.h"
+
+namespace vpw {
+
+ring_buffer::ring_buffer(size_t min_size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	for(size_ = page; size_ < min_size; size_ <<= 1);
+
+	int fd = memfd_create("vpw_ring", MFD_CLOEXEC);
+	if(fd < 0) throw std::system_error(errno, std::generic_category(), "memfd_create");
+
+	if(ftruncate(fd, size_) < 0)
+	{
+		close(fd);
+		throw std::system_error(errno, std::generic_category(), "ftruncate");
+	}
+
+	// reserve twice the size, then map the same pages into both halves
+	void *area = mmap(nullptr, 2 * size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(area == MAP_FAILED)
+	{
+		close(fd);
+		throw std::system_error(errno, std::generic_category(), "mmap");
+	}
+	base_ = static_cast<uint8_t *>(area);
+
+	if(mmap(base_, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	   mmap(base_ + size_, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{
+		int err = errno;
+		munmap(base_, 2 * size_);
+		close(fd);
+		throw std::system_error(err, std::generic_category(), "mmap");
+	}
+	close(fd);	// mappings keep the memory alive
+}
+
+ring_buffer::~ring_buffer()
+{
+	munmap(base_, 2 * size_);
+}
+
+} // namespace vpw
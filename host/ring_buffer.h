@@ -0,0 +1,57 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Byte ring buffer mapped twice back to back in virtual memory, so any
+**	readable or writable region is contiguous. Lines and packed frames can
+**	be parsed in place even when they wrap around the end of the buffer.
+**
+**************************************************************************/
+#ifndef __VPW_RING_BUFFER_H__
+#define __VPW_RING_BUFFER_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace vpw {
+
+class ring_buffer
+{
+public:
+	explicit ring_buffer(size_t min_size);	// size is rounded up to the page size
+	~ring_buffer();
+
+	ring_buffer(const ring_buffer &) = delete;
+	ring_buffer &operator=(const ring_buffer &) = delete;
+
+	// producer side
+	uint8_t *write_ptr() { return base_ + (head_ & (size_ - 1)); }
+	size_t write_space() const { return size_ - (head_ - tail_); }
+	void commit(size_t n) { head_ += n; }
+
+	// consumer side, read_ptr()[0 .. read_avail()-1] is always contiguous
+	const uint8_t *read_ptr() const { return base_ + (tail_ & (size_ - 1)); }
+	size_t read_avail() const { return head_ - tail_; }
+	void consume(size_t n) { tail_ += n; }
+
+	size_t size() const { return size_; }
+
+private:
+	uint8_t *base_;
+	size_t size_;	// power of 2, multiple of the page size
+	size_t head_ = 0;	// free running write counter
+	size_t tail_ = 0;	// free running read counter
+};
+
+} // namespace vpw
+
+#endif // __VPW_RING_BUFFER_H__
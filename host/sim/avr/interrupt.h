@@ -0,0 +1,29 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Stand in for <avr/interrupt.h> on the host. Interrupts are not
+**	simulated, vpw::avr_sim updates the Timer0 overflow counters itself.
+**
+**************************************************************************/
+#ifndef __SIM_AVR_INTERRUPT_H__
+#define __SIM_AVR_INTERRUPT_H__
+
+#include <avr/io.h>
+
+#define cli()	((void)0)
+#define sei()	((void)0)
+
+#define _VECTOR(N)	__vector_ ## N
+#define ISR(vector, ...)	void vector(void); void vector(void)
+
+#endif // __SIM_AVR_INTERRUPT_H__
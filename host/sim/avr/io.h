@@ -0,0 +1,69 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Stand in for <avr/io.h> when the firmware J1850 driver is compiled on
+**	the host. Every register access goes through vpw::avr_sim, which
+**	advances the simulated clock, runs Timer0/Timer1 and drives PINC from
+**	the replayed bus waveform. Only the registers used by j1850.c exist.
+**
+**************************************************************************/
+#ifndef __SIM_AVR_IO_H__
+#define __SIM_AVR_IO_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum sim_reg
+{
+	SIM_PINC,
+	SIM_PORTC,
+	SIM_DDRC,
+	SIM_TCCR0,
+	SIM_TCNT0,
+	SIM_TIMSK,
+	SIM_TIFR,
+	SIM_TCCR1B,
+	SIM_SREG,
+	SIM_REG_COUNT
+};
+
+volatile uint8_t *sim_reg8(enum sim_reg reg);
+volatile uint16_t *sim_tcnt1(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define PINC	(*sim_reg8(SIM_PINC))
+#define PORTC	(*sim_reg8(SIM_PORTC))
+#define DDRC	(*sim_reg8(SIM_DDRC))
+#define TCCR0	(*sim_reg8(SIM_TCCR0))
+#define TCNT0	(*sim_reg8(SIM_TCNT0))
+#define TIMSK	(*sim_reg8(SIM_TIMSK))
+#define TIFR	(*sim_reg8(SIM_TIFR))
+#define TCCR1B	(*sim_reg8(SIM_TCCR1B))
+#define SREG	(*sim_reg8(SIM_SREG))
+#define TCNT1	(*sim_tcnt1())
+
+#define CS02	2
+#define TOIE0	0
+#define TOV0	0
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+#endif // __SIM_AVR_IO_H__
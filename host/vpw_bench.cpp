@@ -0,0 +1,210 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Throughput and latency benchmark for the interface or its emulator.
+**
+**	vpw_bench [--device /dev/ttyUSB0 | --emulate] [options]
+**	  --baud N          serial baud rate (device) or output pacing (emulator)
+**	  --requests N      number of requests to measure, default 1000
+**	  --pipeline        use pipelined requests (ATQ1)
+**	  --targets N       round robin over N receive addresses, default 1
+**	  --packed          use packed output (ATPD)
+**	  --no-spaces       ASCII output without spaces (ATS0)
+**	  --monitor S       measure ATMA frames/s for S seconds, default 0
+**	  --response-us N   emulated ECU response time, default 5000
+**	  --frame-rate N    emulated bus frames/s, default 500
+**
+**	Returns 0 when every request got a response and monitoring saw frames.
+**
+**************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "vpw_client.h"
+#include "vpw_emulator.h"
+
+using clock_type = std::chrono::steady_clock;
+
+struct options
+{
+	std::string device;
+	bool emulate = false;
+	unsigned baud = 0;
+	unsigned requests = 1000;
+	bool pipeline = false;
+	unsigned targets = 1;
+	bool packed = false;
+	bool spaces = true;
+	double monitor = 0;
+	vpw::emulator::config emu;
+};
+
+static void usage(void)
+{
+	std::fprintf(stderr,
+		"usage: vpw_bench [--device PATH | --emulate] [--baud N] [--requests N]\n"
+		"                 [--pipeline] [--targets N] [--packed] [--no-spaces] [--monitor S]\n"
+		"                 [--response-us N] [--frame-rate N]\n");
+	std::exit(2);
+}
+
+static options parse_args(int argc, char **argv)
+{
+	options o;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string a = argv[i];
+		auto value = [&]() -> const char * {
+			if(i + 1 >= argc) usage();
+			return argv[++i];
+		};
+
+		if(a == "--device") o.device = value();
+		else if(a == "--emulate") o.emulate = true;
+		else if(a == "--baud") o.baud = std::atoi(value());
+		else if(a == "--requests") o.requests = std::atoi(value());
+		else if(a == "--pipeline") o.pipeline = true;
+		else if(a == "--targets") o.targets = std::max(1, std::atoi(value()));
+		else if(a == "--packed") o.packed = true;
+		else if(a == "--no-spaces") o.spaces = false;
+		else if(a == "--monitor") o.monitor = std::atof(value());
+		else if(a == "--response-us") o.emu.response_us = std::atoi(value());
+		else if(a == "--frame-rate") o.emu.frame_rate = std::atoi(value());
+		else usage();
+	}
+	if(o.device.empty() != o.emulate) usage();
+	return o;
+}
+
+static double ms(clock_type::duration d)
+{
+	return std::chrono::duration<double, std::milli>(d).count();
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+	if(v.empty()) return 0;
+	size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+static std::string set_header(unsigned target)
+{
+	char line[16];
+	std::snprintf(line, sizeof(line), "ATSH6C%02XF1", 0x10 + target);
+	return line;
+}
+
+// requests round robin over the targets, returns number of failed requests
+static unsigned bench_requests(vpw::client &c, const options &o)
+{
+	struct in_flight
+	{
+		std::future<vpw::response> result;
+		clock_type::time_point start;
+	};
+
+	std::vector<double> latency;
+	std::deque<in_flight> queue;
+	unsigned failed = 0;
+	unsigned depth = o.pipeline ? o.targets : 1;
+
+	auto collect = [&]() {
+		vpw::response r = queue.front().result.get();
+		latency.push_back(ms(clock_type::now() - queue.front().start));
+		if(r.code != vpw::status::data || r.crc_error) ++failed;
+		queue.pop_front();
+	};
+
+	if(o.pipeline) c.command("ATQ1").get();
+	if(o.targets == 1) c.command(set_header(0)).get();
+
+	clock_type::time_point t0 = clock_type::now();
+	for(unsigned i = 0; i < o.requests; ++i)
+	{
+		if(queue.size() >= depth) collect();
+		if(o.targets > 1) c.command(set_header(i % o.targets));
+		queue.push_back({ c.request({ 0x22, 0x12, static_cast<uint8_t>(i) }), clock_type::now() });
+	}
+	while(!queue.empty()) collect();
+	double total = ms(clock_type::now() - t0) / 1000;
+
+	if(o.pipeline) c.command("ATQ0").get();
+
+	double p50 = percentile(latency, 0.50), p95 = percentile(latency, 0.95), p99 = percentile(latency, 0.99);
+	std::printf("requests: %u in %.3f s, %.1f req/s, latency p50 %.2f ms p95 %.2f ms p99 %.2f ms, %u failed\n",
+				o.requests, total, o.requests / total, p50, p95, p99, failed);
+	return failed;
+}
+
+// monitor all traffic, returns number of frames seen
+static uint64_t bench_monitor(vpw::client &c, const options &o)
+{
+	uint64_t frames = 0, crc_errors = 0;
+	uint64_t bytes0 = c.bytes_received();
+
+	clock_type::time_point t0 = clock_type::now();
+	c.monitor("ATMA", [&](const vpw::frame_view &f) {
+		++frames;
+		if(f.crc_error) ++crc_errors;
+	});
+	std::this_thread::sleep_for(std::chrono::duration<double>(o.monitor));
+	vpw::response r = c.stop_monitor().get();
+	double total = ms(clock_type::now() - t0) / 1000;
+
+	std::printf("monitor: %llu frames in %.3f s, %.1f frames/s, %.0f bytes/s, %llu crc errors%s\n",
+				(unsigned long long)frames, total, frames / total, (c.bytes_received() - bytes0) / total,
+				(unsigned long long)crc_errors, r.code == vpw::status::stopped ? "" : ", no STOPPED");
+	return frames;
+}
+
+int main(int argc, char **argv)
+{
+	options o = parse_args(argc, argv);
+	std::unique_ptr<vpw::emulator> emu;
+
+	if(o.emulate)
+	{
+		o.emu.baud = o.baud;
+		emu.reset(new vpw::emulator(o.emu));
+		o.device = emu->device();
+	}
+
+	vpw::client c(o.device, o.emulate || !o.baud ? 115200 : o.baud);
+	int rc = 0;
+
+	c.command("ATE0").get();
+	if(o.packed) c.command("ATPD").get();
+	if(!o.spaces) c.command("ATS0").get();
+
+	if(o.requests && bench_requests(c, o)) rc = 1;
+	if(o.monitor > 0)
+	{
+		if(!bench_monitor(c, o)) rc = 1;
+		if(emu) std::printf("emulator: %llu frames sent, %llu dropped by the serial link\n",
+							(unsigned long long)emu->frames_sent(), (unsigned long long)emu->frames_dropped());
+	}
+
+	if(o.packed) c.command("ATFD").get();
+	if(!o.spaces) c.command("ATS1").get();
+	return rc;
+}
@@ -0,0 +1,551 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**************************************************************************/
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include "vpw_client.h"
+
+namespace vpw {
+
+namespace {
+
+speed_t baud_constant(unsigned baud)
+{
+	switch(baud)
+	{
+		case 9600:   return B9600;
+		case 19200:  return B19200;
+		case 38400:  return B38400;
+		case 57600:  return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		default:     throw std::invalid_argument("unsupported baud rate");
+	}
+}
+
+int hex_nibble(uint8_t c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+// decode "6C F1 10" or "6CF110" into bytes, -1 when the text is no hex frame
+int decode_hex(std::string_view text, uint8_t *out, size_t max)
+{
+	size_t n = 0;
+	size_t i = 0;
+
+	while(i < text.size())
+	{
+		if(text[i] == ' ')
+		{
+			++i;
+			continue;
+		}
+		if(i + 1 >= text.size() || n >= max) return -1;
+
+		int hi = hex_nibble(text[i]);
+		int lo = hex_nibble(text[i + 1]);
+		if(hi < 0 || lo < 0) return -1;
+
+		out[n++] = (hi << 4) | lo;
+		i += 2;
+	}
+	return n ? static_cast<int>(n) : -1;
+}
+
+std::string upper(const std::string &s)
+{
+	std::string u(s);
+	std::transform(u.begin(), u.end(), u.begin(), [](unsigned char c) { return std::toupper(c); });
+	return u;
+}
+
+} // namespace
+
+client::client(const std::string &device, unsigned baud)
+{
+	fd_ = ::open(device.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if(fd_ < 0) throw std::system_error(errno, std::generic_category(), device);
+
+	termios tio;
+	if(tcgetattr(fd_, &tio) < 0)
+	{
+		int err = errno;
+		::close(fd_);
+		throw std::system_error(err, std::generic_category(), "tcgetattr");
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, baud_constant(baud));
+	cfsetospeed(&tio, baud_constant(baud));
+	tcsetattr(fd_, TCSANOW, &tio);
+	tcflush(fd_, TCIOFLUSH);
+
+	start();
+}
+
+client::client(int fd) : fd_(fd)
+{
+	start();
+}
+
+void client::start()
+{
+	if(pipe2(wake_, O_CLOEXEC) < 0)
+	{
+		int err = errno;
+		::close(fd_);
+		throw std::system_error(err, std::generic_category(), "pipe2");
+	}
+	reader_ = std::thread(&client::reader, this);
+}
+
+client::~client()
+{
+	char c = 0;
+	(void)!::write(wake_[1], &c, 1);
+	reader_.join();
+	::close(wake_[0]);
+	::close(wake_[1]);
+	::close(fd_);
+}
+
+std::future<response> client::command(const std::string &line)
+{
+	std::promise<response> result;
+	std::future<response> f = result.get_future();
+	send_line(line, kind::at, &result);
+	return f;
+}
+
+std::future<response> client::request(const std::vector<uint8_t> &data)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	std::string line;
+
+	for(uint8_t b : data)
+	{
+		line += digits[b >> 4];
+		line += digits[b & 0x0F];
+	}
+
+	std::promise<response> result;
+	std::future<response> f = result.get_future();
+	send_line(line, kind::hex, &result);
+	return f;
+}
+
+void client::monitor(const std::string &line, frame_callback cb)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		monitor_cb_ = std::move(cb);
+	}
+	send_line(line, kind::at, nullptr);
+}
+
+std::future<response> client::stop_monitor()
+{
+	std::promise<response> result;
+	std::future<response> f = result.get_future();
+
+	// continuous monitoring ignores chars, any char ends the other monitor modes
+	send_line(continuous_ ? "ATMC0" : "", kind::monitor_stop, &result);
+	return f;
+}
+
+void client::on_frame(frame_callback cb)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	frame_cb_ = std::move(cb);
+}
+
+void client::set_window(unsigned lines)
+{
+	std::lock_guard<std::mutex> guard(lock_);
+	window_ = lines ? lines : 1;
+	room_.notify_all();
+}
+
+/*
+**	Queue the expected answer and write the line. Monitor mode commands have
+**	no answer at all, they resolve immediately.
+*/
+void client::send_line(const std::string &line, kind what, std::promise<response> *result)
+{
+	static std::mutex write_lock;	// keeps write order equal to queue order
+	std::lock_guard<std::mutex> wguard(write_lock);
+
+	std::string u = upper(line);
+	bool silent = (what == kind::at) && u.size() >= 4 && u.compare(0, 3, "ATM") == 0 &&
+				  std::strchr("ARTI", u[3]) != nullptr;
+
+	{
+		std::unique_lock<std::mutex> guard(lock_);
+		room_.wait(guard, [this] { return pending_.size() < window_; });
+
+		track_mode(u);
+		if(silent)
+		{
+			if(result)
+			{
+				response r;
+				r.code = status::ok;
+				result->set_value(std::move(r));
+			}
+		}
+		else
+		{
+			pending_.emplace_back();
+			pending_.back().what = what;
+			if(result) pending_.back().result = std::move(*result);
+		}
+	}
+
+	std::string out = line + '\r';
+	const char *p = out.data();
+	size_t n = out.size();
+	while(n)
+	{
+		ssize_t w = ::write(fd_, p, n);
+		if(w < 0)
+		{
+			if(errno == EINTR) continue;
+			throw std::system_error(errno, std::generic_category(), "write");
+		}
+		p += w;
+		n -= w;
+	}
+}
+
+// follow the output format switches of our own commands
+void client::track_mode(const std::string &u)
+{
+	if(u == "ATPD") packed_ = true;
+	else if(u == "ATFD") packed_ = false;
+	else if(u == "ATQ1") pipelined_ = true;
+	else if(u == "ATQ0") pipelined_ = false;
+	else if(u == "ATMC1") continuous_ = true;
+	else if(u == "ATMC0") continuous_ = false;
+	else if(u == "ATD" || u == "ATZ")
+	{
+		packed_ = false;
+		pipelined_ = false;
+		continuous_ = false;
+		monitoring_ = false;
+	}
+	else if(u.size() >= 4 && u.compare(0, 3, "ATM") == 0 && std::strchr("ARTI", u[3]))
+		monitoring_ = true;
+}
+
+void client::reader()
+{
+	pollfd fds[2] = { { fd_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+
+	for(;;)
+	{
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(fds[1].revents) break;	// shutdown
+
+		ssize_t n = ::read(fd_, ring_.write_ptr(), ring_.write_space());
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) break;	// device gone
+
+		ring_.commit(n);
+		rx_bytes_ += n;
+
+		std::lock_guard<std::mutex> guard(lock_);
+		ring_.consume(parse(ring_.read_ptr(), ring_.read_avail()));
+		if(ring_.write_space() == 0) ring_.consume(ring_.read_avail());	// garbage, resync
+	}
+
+	std::lock_guard<std::mutex> guard(lock_);
+	for(auto &p : pending_) finish(p, status::closed);
+	for(auto &p : pipe_) finish(p.second, status::closed);
+	pending_.clear();
+	pipe_.clear();
+	room_.notify_all();
+}
+
+/*
+**	Parse as much as possible of the received data in place.
+**	Returns the number of bytes consumed, an incomplete line or frame stays.
+*/
+size_t client::parse(const uint8_t *p, size_t n)
+{
+	size_t used = 0;
+
+	while(used < n)
+	{
+		// pipelined responses may arrive between the lines of any other command
+		bool text = !packed_ || (p[used] != tag_pipe && !pending_.empty() &&
+								 pending_.front().what != kind::hex && !monitoring_);
+
+		if(!text)
+		{
+			size_t k = parse_packed(p + used, n - used);
+			if(!k) break;
+			used += k;
+			continue;
+		}
+
+		uint8_t c = p[used];
+		if(c == '\n' || c == '\r')
+		{
+			++used;
+			continue;
+		}
+		if(c == '>')  // prompt
+		{
+			++used;
+			complete_front(status::ok);
+			continue;
+		}
+
+		const uint8_t *cr = static_cast<const uint8_t *>(std::memchr(p + used, '\r', n - used));
+		if(!cr) break;
+
+		handle_line(std::string_view(reinterpret_cast<const char *>(p + used), cr - (p + used)));
+		used = cr - p + 1;
+	}
+	return used;
+}
+
+size_t client::parse_packed(const uint8_t *p, size_t n)
+{
+	uint8_t b = p[0];
+
+	if(b == '\r')  // prompt "\r>" or the length byte of a 13 byte frame
+	{
+		if(n < 2) return 0;
+		if(p[1] == '>')
+		{
+			complete_front(status::ok);
+			return 2;
+		}
+	}
+
+	if((b >= 'A' && b <= 'Z') || b == '?' || b == '<')  // status text
+	{
+		const uint8_t *cr = static_cast<const uint8_t *>(std::memchr(p, '\r', n));
+		if(!cr) return 0;
+		handle_line(std::string_view(reinterpret_cast<const char *>(p), cr - p));
+		return cr - p + 1;
+	}
+
+	size_t head = 0;
+	uint8_t tag = tag_none;
+	uint8_t request_tag = 0;
+
+	if(b >= tag_tx && b <= tag_pipe)
+	{
+		tag = b;
+		head = 1;
+		if(tag == tag_pipe)
+		{
+			if(n < 2) return 0;
+			request_tag = p[1];
+			head = 2;
+
+			// unknown tag: acknowledge of the request we just sent, prompt follows
+			if(!pipe_.count(request_tag))
+			{
+				if(!pending_.empty() && pending_.front().what == kind::hex)
+				{
+					pending_.front().acked = true;
+					pipe_.emplace(request_tag, std::move(pending_.front()));
+					pipe_[request_tag].partial.request_tag = request_tag;
+					if(monitoring_ && continuous_) complete_front(status::ok);
+				}
+				return 2;
+			}
+		}
+	}
+
+	if(n <= head) return 0;
+	uint8_t len_byte = p[head];
+	size_t len = len_byte & 0x7F;
+	bool crc_error = len_byte & 0x80;
+	if(n < head + 1 + len) return 0;
+
+	const uint8_t *data = p + head + 1;
+	if(tag == tag_pipe)
+		handle_pipe(request_tag, data, len, crc_error, len_byte == 0);
+	else
+		handle_frame(data, len, tag, crc_error, std::string_view());
+
+	return head + 1 + len;
+}
+
+void client::handle_line(std::string_view line)
+{
+	while(!line.empty() && line.back() == ' ') line.remove_suffix(1);
+	if(line.empty()) return;
+
+	pending *front = pending_.empty() ? nullptr : &pending_.front();
+
+	if(line == "OK")
+	{
+		if(front) front->partial.code = status::ok;
+		return;
+	}
+	if(line == "?")  // unknown command, no prompt follows
+	{
+		complete_front(status::unknown);
+		return;
+	}
+	if(line == "NO DATA" || line == "BUSBUSY" || line == "BUSERROR" || line == "<DATAERROR")
+	{
+		if(front)
+			front->partial.code = line == "NO DATA" ? status::no_data :
+								  line == "BUSBUSY" ? status::bus_busy :
+								  line == "BUSERROR" ? status::bus_error : status::data_error;
+		return;
+	}
+	if(line == "STOPPED")
+	{
+		monitoring_ = false;
+		if(front) front->partial.code = status::stopped;
+		return;
+	}
+
+	// pipelined request "#tt" acknowledge, "#tt <frame>" or "#tt NO DATA"
+	if(line[0] == '#' && line.size() >= 3)
+	{
+		uint8_t request_tag;
+		if(decode_hex(line.substr(1, 2), &request_tag, 1) == 1)
+		{
+			std::string_view rest = line.substr(3);
+			while(!rest.empty() && rest.front() == ' ') rest.remove_prefix(1);
+
+			if(!pipe_.count(request_tag))
+			{
+				if(rest.empty() && front && front->what == kind::hex)
+				{
+					front->acked = true;
+					pipe_.emplace(request_tag, std::move(*front));
+					pipe_[request_tag].partial.request_tag = request_tag;
+					if(monitoring_ && continuous_) complete_front(status::ok);
+				}
+				return;
+			}
+			int len = rest == "NO DATA" ? 0 : decode_hex(rest, scratch_, sizeof(scratch_));
+			if(len >= 0) handle_pipe(request_tag, scratch_, len, false, len == 0);
+			return;
+		}
+	}
+
+	// tagged own traffic in continuous monitor mode
+	if(line.size() > 2 && line[1] == ' ' && std::strchr("TRN", line[0]))
+	{
+		int len = decode_hex(line.substr(2), scratch_, sizeof(scratch_));
+		if(len > 0)
+		{
+			uint8_t tag = line[0] == 'T' ? tag_tx : line[0] == 'R' ? tag_resp : tag_neg;
+			handle_frame(scratch_, len, tag, false, line);
+			return;
+		}
+	}
+
+	int len = decode_hex(line, scratch_, sizeof(scratch_));
+	if(len > 0)
+	{
+		handle_frame(scratch_, len, tag_none, false, line);
+		return;
+	}
+
+	if(front) front->partial.text.emplace_back(line);
+}
+
+void client::handle_frame(const uint8_t *data, size_t len, uint8_t tag, bool crc_error, std::string_view text)
+{
+	pending *front = pending_.empty() ? nullptr : &pending_.front();
+	bool for_request = front && front->what == kind::hex && !front->acked;
+
+	if(for_request && (tag == tag_resp || tag == tag_neg || (tag == tag_none && !monitoring_)))
+	{
+		front->partial.bytes.assign(data, data + len);
+		front->partial.tag = tag == tag_neg ? tag_neg : tag_none;
+		front->partial.crc_error = crc_error;
+		front->partial.code = crc_error ? (len ? status::data_error : status::bus_error) :
+							  len ? status::data : status::no_data;
+
+		// continuous monitoring prints no prompt after a response
+		if(monitoring_ && continuous_) complete_front(front->partial.code);
+		return;
+	}
+
+	frame_view v { data, len, tag, crc_error, text };
+	if(monitoring_ && monitor_cb_) monitor_cb_(v);
+	else if(frame_cb_) frame_cb_(v);
+}
+
+void client::handle_pipe(uint8_t request_tag, const uint8_t *data, size_t len, bool crc_error, bool no_data)
+{
+	auto it = pipe_.find(request_tag);
+	if(it == pipe_.end()) return;
+
+	response &r = it->second.partial;
+	r.bytes.assign(data, data + len);
+	r.crc_error = crc_error;
+	finish(it->second, no_data ? status::no_data : crc_error ? status::data_error : status::data);
+	pipe_.erase(it);
+}
+
+void client::complete_front(status code)
+{
+	if(pending_.empty()) return;
+
+	pending &p = pending_.front();
+	if(!p.acked)
+	{
+		// keep a status seen before the prompt, "OK" is the default
+		status c = p.partial.code == status::closed ? code : p.partial.code;
+		finish(p, c);
+	}
+	pending_.pop_front();
+	room_.notify_all();
+}
+
+void client::finish(pending &p, status code)
+{
+	p.partial.code = code;
+	try
+	{
+		p.result.set_value(std::move(p.partial));
+	}
+	catch(const std::future_error &)
+	{
+		// no future attached (monitor command) or already satisfied
+	}
+}
+
+} // namespace vpw
@@ -0,0 +1,167 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Asynchronous client for the AT command set of the interface. Commands
+**	and requests return futures, monitor frames are delivered to a callback
+**	as views into the receive ring buffer. A reader thread owns the serial
+**	port input and resolves all futures and callbacks.
+**
+**	Packed output is only unambiguous for frames up to 12 bytes (ATC1) and
+**	without linefeeds (ATL0), see README.
+**
+**************************************************************************/
+#ifndef __VPW_CLIENT_H__
+#define __VPW_CLIENT_H__
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "ring_buffer.h"
+
+namespace vpw {
+
+// result of a command, mirrors the firmware return codes
+enum class status
+{
+	ok,			// "OK"
+	data,		// response data
+	no_data,	// "NO DATA" or empty packed response
+	bus_busy,	// "BUSBUSY"
+	bus_error,	// "BUSERROR" or packed length 0x80
+	data_error,	// "<DATAERROR" or packed length with error bit
+	unknown,	// "?"
+	stopped,	// "STOPPED", monitor mode ended
+	closed		// client shut down before completion
+};
+
+// monitor output tags, see MON_TAG_xx in main.h
+enum tag : uint8_t
+{
+	tag_none = 0x00,
+	tag_tx   = 0xF1,	// frame sent by us
+	tag_resp = 0xF2,	// response to a frame sent by us
+	tag_neg  = 0xF3,	// negative response to a frame sent by us
+	tag_pipe = 0xF4	// response to a pipelined request
+};
+
+struct response
+{
+	status code = status::closed;
+	std::vector<uint8_t> bytes;		// response frame as output (headers/CRC per ATH)
+	std::vector<std::string> text;	// other text lines, e.g. ident
+	uint8_t tag = tag_none;			// tag_neg for negative responses
+	uint8_t request_tag = 0;		// tag of a pipelined request
+	bool crc_error = false;
+};
+
+// frame seen in the monitor stream, only valid during the callback
+struct frame_view
+{
+	const uint8_t *data;
+	size_t len;
+	uint8_t tag;				// tag_none for bus traffic
+	bool crc_error;
+	std::string_view text;	// formatted line, empty in packed mode
+};
+
+class client
+{
+public:
+	using frame_callback = std::function<void(const frame_view &)>;
+
+	client(const std::string &device, unsigned baud = 115200);
+	explicit client(int fd);	// takes ownership of an open tty
+	~client();
+
+	client(const client &) = delete;
+	client &operator=(const client &) = delete;
+
+	// send one command line (AT command or hex request) without CR
+	std::future<response> command(const std::string &line);
+
+	// send a hex request with the current header
+	std::future<response> request(const std::vector<uint8_t> &data);
+
+	// enter a monitor mode (ATMA, ATMR xx, ATMT xx, ATMI xx), frames go to the callback
+	void monitor(const std::string &line, frame_callback cb);
+
+	// end a monitor mode, resolves with status::stopped
+	std::future<response> stop_monitor();
+
+	// frames seen while not monitoring, e.g. continuous monitor mode
+	void on_frame(frame_callback cb);
+
+	// number of command lines sent ahead before the previous prompt arrived,
+	// only raise above 1 with flow control (ATK1/ATK2) enabled
+	void set_window(unsigned lines);
+
+	uint64_t bytes_received() const { return rx_bytes_; }
+
+private:
+	enum class kind { at, hex, monitor_stop };
+
+	struct pending
+	{
+		kind what;
+		std::promise<response> result;
+		response partial;
+		bool acked = false;	// pipelined request moved to pipe_
+	};
+
+	void start();
+	void send_line(const std::string &line, kind what, std::promise<response> *result);
+	void track_mode(const std::string &line);
+	void reader();
+	size_t parse(const uint8_t *p, size_t n);
+	size_t parse_packed(const uint8_t *p, size_t n);
+	void handle_line(std::string_view line);
+	void handle_frame(const uint8_t *data, size_t len, uint8_t tag, bool crc_error, std::string_view text);
+	void handle_pipe(uint8_t request_tag, const uint8_t *data, size_t len, bool crc_error, bool no_data);
+	void complete_front(status code);
+	void finish(pending &p, status code);
+
+	int fd_;
+	int wake_[2];	// self pipe to stop the reader thread
+	std::thread reader_;
+	ring_buffer ring_{1 << 16};
+
+	std::mutex lock_;
+	std::condition_variable room_;
+	std::deque<pending> pending_;	// commands waiting for their prompt
+	std::map<uint8_t, pending> pipe_;	// pipelined requests by tag
+	unsigned window_ = 1;
+
+	frame_callback monitor_cb_;
+	frame_callback frame_cb_;
+
+	// firmware output mode as set by our own commands
+	bool packed_ = false;
+	bool monitoring_ = false;
+	bool continuous_ = false;
+	bool pipelined_ = false;
+
+	uint8_t scratch_[64];	// decoded formatted frame
+	uint64_t rx_bytes_ = 0;
+};
+
+} // namespace vpw
+
+#endif // __VPW_CLIENT_H__
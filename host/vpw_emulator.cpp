@@ -0,0 +1,448 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**************************************************************************/
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <system_error>
+#include "vpw_emulator.h"
+#include "vpw_trace.h"
+
+namespace vpw {
+
+namespace {
+
+// firmware return codes, see j1850.h
+const int code_unknown = 0;
+const int code_ok = 1;
+const int code_no_data = 5;
+const int code_data = 6;
+
+uint8_t hex_byte(const char *p)
+{
+	return std::stoi(std::string(p, 2), nullptr, 16);
+}
+
+} // namespace
+
+emulator::emulator(const config &cfg) : cfg_(cfg)
+{
+	master_ = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if(master_ < 0 || grantpt(master_) < 0 || unlockpt(master_) < 0)
+		throw std::system_error(errno, std::generic_category(), "posix_openpt");
+	slave_ = ptsname(master_);
+
+	// raw slave side, the client sets the same but may open late
+	int s = ::open(slave_.c_str(), O_RDWR | O_NOCTTY);
+	if(s >= 0)
+	{
+		termios tio;
+		tcgetattr(s, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(s, TCSANOW, &tio);
+		::close(s);
+	}
+
+	fcntl(master_, F_SETFL, fcntl(master_, F_GETFL) | O_NONBLOCK);
+	if(pipe2(wake_, O_CLOEXEC) < 0) throw std::system_error(errno, std::generic_category(), "pipe2");
+
+	// like a device that is already running, no ident until ATZ/ATI
+	busy_until_ = next_frame_ = clock::now();
+	thread_ = std::thread(&emulator::run, this);
+}
+
+emulator::~emulator()
+{
+	char c = 0;
+	(void)!::write(wake_[1], &c, 1);
+	thread_.join();
+	::close(wake_[0]);
+	::close(wake_[1]);
+	::close(master_);
+}
+
+void emulator::run()
+{
+	clock::time_point link_free = clock::now();	// paced output may continue from here
+	std::vector<uint8_t> buf(4096);
+
+	for(;;)
+	{
+		clock::time_point now = clock::now();
+		clock::time_point wake = now + std::chrono::milliseconds(100);
+
+		if(!lines_.empty() && busy_until_ > now) wake = std::min(wake, busy_until_);
+		for(auto &e : events_) wake = std::min(wake, e.due);
+		if(monitoring_ && cfg_.frame_rate) wake = std::min(wake, next_frame_);
+		if(!out_.empty()) wake = std::min(wake, std::max(now, link_free));
+
+		int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count();
+		pollfd fds[2] = { { master_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+		if(poll(fds, 2, std::max(timeout, 0)) < 0 && errno != EINTR) return;
+		if(fds[1].revents) return;
+
+		if(fds[0].revents & POLLIN)
+		{
+			ssize_t n = ::read(master_, buf.data(), buf.size());
+			for(ssize_t i = 0; i < n; ++i) input(buf[i]);
+		}
+
+		now = clock::now();
+
+		// responses due
+		for(size_t i = 0; i < events_.size();)
+		{
+			if(events_[i].due <= now)
+			{
+				event e = events_[i];
+				events_.erase(events_.begin() + i);
+				fire(e);
+			}
+			else
+				++i;
+		}
+
+		// commands waiting for a blocking request or a pipeline slot
+		while(!lines_.empty() && busy_until_ <= now && execute(lines_.front())) lines_.pop_front();
+
+		// monitor traffic, dropped when the serial link cannot keep up like the firmware would
+		if(cfg_.frame_rate)
+		{
+			auto period = std::chrono::nanoseconds(1000000000ull / cfg_.frame_rate);
+			while(monitoring_ && next_frame_ <= now)
+			{
+				if(out_.size() < 256)
+				{
+					uint8_t cnt_hi = counter_ >> 8, cnt_lo = counter_;
+					std::vector<uint8_t> f = { 0x48, 0x6B, 0x10, 0x41, 0x0C, cnt_hi, cnt_lo };
+					f.push_back(crc(f.data(), f.size()));
+					output_frame(f, 0);
+					++counter_;
+					++frames_sent_;
+				}
+				else
+					++frames_dropped_;
+				next_frame_ += period;
+			}
+			if(!monitoring_) next_frame_ = now;
+		}
+
+		// paced output
+		if(!out_.empty() && link_free <= now)
+		{
+			size_t n = out_.size();
+			if(cfg_.baud)
+			{
+				// send what the link could have carried since it got free, at least one char
+				auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - link_free).count();
+				n = std::min<size_t>(n, std::max<size_t>(1, elapsed * cfg_.baud / 10000000));
+			}
+			ssize_t w = ::write(master_, out_.data(), n);
+			if(w > 0)
+			{
+				out_.erase(0, w);
+				if(cfg_.baud) link_free = now + std::chrono::microseconds(w * 10000000ull / cfg_.baud);
+			}
+		}
+	}
+}
+
+// Rx path of the firmware: serial_rx_char() and the monitor stop in main()
+void emulator::input(uint8_t c)
+{
+	if(monitoring_ && !continuous_)
+	{
+		monitoring_ = false;	// any char ends monitoring, char is discarded
+		puts("STOPPED\r");
+		if(linefeed_) put('\n');
+		prompt();
+		return;
+	}
+
+	if(echo_) put(c);
+
+	if(c == '\r')
+	{
+		lines_.push_back(line_);
+		line_.clear();
+		return;
+	}
+	if(std::isalnum(c)) line_ += std::tolower(c);
+}
+
+bool emulator::execute(const std::string &line)
+{
+	if(line.size() >= 2 && line[0] == 'a' && line[1] == 't')
+	{
+		command_at(line.substr(2));
+		return true;
+	}
+	return request(line);
+}
+
+void emulator::command_at(const std::string &cmd)
+{
+	char c = cmd.empty() ? 0 : cmd[0];
+	char arg = cmd.size() > 1 ? cmd[1] : 0;
+
+	switch(c)
+	{
+		case 'e': echo_ = arg != '0'; break;
+		case 'h': headers_ = arg != '0'; break;
+		case 'l': linefeed_ = arg != '0'; break;
+		case 'q': pipeline_ = arg != '0'; break;
+		case 'p':
+			if(arg == 'd') packed_ = true;
+			else if(arg == '0' || arg == '1') prompt_ = arg == '1';
+			break;
+		case 'f': if(arg == 'd') packed_ = false; break;
+		case 'i': puts("AVR-J1850 VPW v1.10\r(emulator)\r\r"); break;
+
+		case 'd':
+			headers_ = spaces_ = prompt_ = true;
+			linefeed_ = packed_ = pipeline_ = continuous_ = false;
+			header_[0] = 0x68; header_[1] = 0x6A; header_[2] = 0xF1;
+			break;
+
+		case 'z':
+			echo_ = linefeed_ = packed_ = pipeline_ = continuous_ = monitoring_ = false;
+			headers_ = spaces_ = prompt_ = true;
+			puts("AVR-J1850 VPW v1.10\r(emulator)\r\r>");
+			return;
+
+		case 's':
+			if(arg == 'h' && cmd.size() == 8)
+			{
+				for(int i = 0; i < 3; ++i) header_[i] = hex_byte(&cmd[2 + 2 * i]);
+				break;
+			}
+			if((arg == '0' || arg == '1') && cmd.size() == 2)
+			{
+				spaces_ = arg == '1';
+				break;
+			}
+			finish(code_unknown);
+			return;
+
+		case 'm':
+			if(arg == 'c')
+			{
+				if(cmd.size() > 2 && cmd[2] == '0')
+				{
+					continuous_ = false;
+					if(monitoring_)
+					{
+						monitoring_ = false;
+						puts("STOPPED\r");
+						finish(code_data);
+						return;
+					}
+				}
+				else
+					continuous_ = true;
+				break;
+			}
+			monitoring_ = true;	// all monitor modes show all traffic here
+			next_frame_ = clock::now();
+			finish(code_data);
+			return;
+
+		default:
+			break;	// accept everything else
+	}
+	finish(code_ok);
+}
+
+// hex request path of serial_processing()
+bool emulator::request(const std::string &hex)
+{
+	if((hex.size() & 1) || hex.size() > 16 ||
+	   !std::all_of(hex.begin(), hex.end(), [](char c) { return std::isxdigit((unsigned char)c); }))
+	{
+		finish(code_unknown);
+		return true;
+	}
+
+	std::vector<uint8_t> tx(header_, header_ + 3);
+	for(size_t i = 0; i < hex.size(); i += 2) tx.push_back(hex_byte(&hex[i]));
+	tx.push_back(crc(tx.data(), tx.size()));
+
+	uint8_t addr = header_[1];
+	if(pipeline_)
+	{
+		size_t in_flight = 0;
+		for(auto &e : events_)
+		{
+			if(!e.tag) continue;
+			if(e.addr == addr) return false;	// one request per receive address
+			++in_flight;
+		}
+		if(in_flight >= 4) return false;	// all slots in use
+	}
+
+	if(monitoring_ && continuous_) output_frame(tx, 0xF1);
+
+	// ECU answers with service id + 0x40 and echoes the request parameters
+	std::vector<uint8_t> rx = { 0x6C, header_[2], header_[1] };
+	if(hex.size() >= 2) rx.push_back(tx[3] + 0x40);
+	for(size_t i = 4; i + 1 < tx.size(); ++i) rx.push_back(tx[i]);
+	rx.push_back(counter_++);
+	rx.push_back(crc(rx.data(), rx.size()));
+
+	event e { clock::now() + std::chrono::microseconds(cfg_.response_us), rx, 0, addr };
+	if(pipeline_)
+	{
+		if(++pipe_tag_ == 0) pipe_tag_ = 1;
+		e.tag = pipe_tag_;
+		pipe_prefix(pipe_tag_);
+		if(!packed_)
+		{
+			put('\r');
+			if(linefeed_) put('\n');
+		}
+		finish(code_data);
+	}
+	else
+		busy_until_ = e.due;	// blocking request, no further commands until answered
+	events_.push_back(e);
+	return true;
+}
+
+void emulator::fire(event &e)
+{
+	if(e.tag)
+	{
+		pipe_prefix(e.tag);
+		output_frame(e.frame, 0xF4);
+		return;
+	}
+
+	if(monitoring_ && continuous_)
+	{
+		output_frame(e.frame, 0xF2);
+		return;	// no prompt while monitoring
+	}
+
+	std::vector<uint8_t> f = e.frame;
+	if(!headers_) f = std::vector<uint8_t>(f.begin() + 3, f.end() - 1);
+	if(packed_)
+	{
+		put(f.size());
+		out_.append(f.begin(), f.end());
+	}
+	else
+	{
+		for(uint8_t b : f)
+		{
+			put_hex(b);
+			if(spaces_) put(' ');
+		}
+		put('\r');
+		if(linefeed_) put('\n');
+	}
+	finish(code_data);
+}
+
+// monitor_output() of the firmware
+void emulator::output_frame(const std::vector<uint8_t> &frame, uint8_t tag)
+{
+	std::vector<uint8_t> f = frame;
+	if(!headers_) f = std::vector<uint8_t>(f.begin() + 3, f.end() - 1);
+
+	if(packed_)
+	{
+		if(tag && tag != 0xF4) put(tag);
+		put(f.size());
+		out_.append(f.begin(), f.end());
+		return;
+	}
+
+	if(tag && tag != 0xF4)
+	{
+		put(" TRN#"[tag & 0x0F]);
+		put(' ');
+	}
+	for(uint8_t b : f)
+	{
+		put_hex(b);
+		if(spaces_) put(' ');
+	}
+	put('\r');
+	if(linefeed_) put('\n');
+}
+
+void emulator::pipe_prefix(uint8_t tag)
+{
+	if(packed_)
+	{
+		put(0xF4);
+		put(tag);
+	}
+	else
+	{
+		put('#');
+		put_hex(tag);
+		put(' ');
+	}
+}
+
+// return code handling of serial_rx_char()
+void emulator::finish(int code)
+{
+	switch(code)
+	{
+		case code_ok:
+			puts("OK\r");
+			if(linefeed_) put('\n');
+			prompt();
+			break;
+
+		case code_no_data:
+			puts("NO DATA\r");
+			if(linefeed_) put('\n');
+			prompt();
+			break;
+
+		case code_data:
+			if(monitoring_) break;
+			if(linefeed_) put('\n');
+			prompt();
+			break;
+
+		default:
+			puts("?\r");
+			if(linefeed_) put('\n');
+	}
+}
+
+void emulator::put_hex(uint8_t b)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	put(digits[b >> 4]);
+	put(digits[b & 0x0F]);
+}
+
+void emulator::prompt()
+{
+	if(!prompt_) return;
+	if(linefeed_) put('\n');
+	puts("\r>");
+}
+
+} // namespace vpw
@@ -0,0 +1,107 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Interface emulator on a pseudo terminal. It answers the AT command
+**	subset used by the client library with the same output format as the
+**	firmware, simulates ECU response times and monitor traffic, and can
+**	pace its output to a serial baud rate. Used by vpw_bench when no
+**	device is attached.
+**
+**************************************************************************/
+#ifndef __VPW_EMULATOR_H__
+#define __VPW_EMULATOR_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace vpw {
+
+class emulator
+{
+public:
+	struct config
+	{
+		unsigned response_us = 5000;	// ECU think time before a response
+		unsigned frame_rate = 500;		// monitor frames/s on the emulated bus
+		unsigned baud = 0;				// serial pacing, 0 = unlimited
+	};
+
+	explicit emulator(const config &cfg);
+	~emulator();
+
+	emulator(const emulator &) = delete;
+	emulator &operator=(const emulator &) = delete;
+
+	const std::string &device() const { return slave_; }	// pty to open with vpw::client
+
+	uint64_t frames_sent() const { return frames_sent_; }
+	uint64_t frames_dropped() const { return frames_dropped_; }
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	struct event
+	{
+		clock::time_point due;
+		std::vector<uint8_t> frame;
+		uint8_t tag;	// pipeline request tag, 0 = blocking request
+		uint8_t addr;
+	};
+
+	void run();
+	void input(uint8_t c);
+	bool execute(const std::string &line);	// false = must wait, line kept
+	void command_at(const std::string &cmd);
+	bool request(const std::string &hex);
+	void finish(int code);
+	void put(uint8_t c) { out_.push_back(c); }
+	void puts(const char *s) { out_.append(s); }
+	void put_hex(uint8_t b);
+	void prompt();
+	void output_frame(const std::vector<uint8_t> &frame, uint8_t tag);
+	void pipe_prefix(uint8_t tag);
+	void fire(event &e);
+
+	config cfg_;
+	int master_;
+	int wake_[2];
+	std::string slave_;
+	std::thread thread_;
+
+	std::string line_;		// command being received
+	std::deque<std::string> lines_;	// complete commands waiting for execution
+	std::string out_;		// output waiting for the paced serial link
+	clock::time_point busy_until_;	// blocking request in progress
+	std::vector<event> events_;
+	clock::time_point next_frame_;
+
+	// emulated firmware settings
+	bool echo_ = false, headers_ = true, linefeed_ = false, packed_ = false;
+	bool pipeline_ = false, monitoring_ = false, continuous_ = false;
+	bool spaces_ = true, prompt_ = true;
+	uint8_t header_[3] = { 0x68, 0x6A, 0xF1 };
+	uint8_t pipe_tag_ = 0;
+	uint16_t counter_ = 0;
+
+	std::atomic<uint64_t> frames_sent_{0};
+	std::atomic<uint64_t> frames_dropped_{0};
+};
+
+} // namespace vpw
+
+#endif // __VPW_EMULATOR_H__
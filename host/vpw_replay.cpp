@@ -0,0 +1,271 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Replays a trace into the firmware receiver, src/j1850.c built against
+**	the simulated ATmega of vpw_sim.h, and pushes every decoded frame
+**	through a model of the monitor output path: fixed CPU cost per frame
+**	and per character, the Tx ring buffer and the UART at the baud rate.
+**	A full ring blocks the main loop like serial_putc() does, frames sent
+**	meanwhile are lost. Same traces give the same numbers, so a firmware
+**	change can be compared before and after.
+**
+**	vpw_replay [options] trace
+**	  --baud N          serial baud rate, default 115200
+**	  --packed          packed output (ATPD), default ASCII "XX XX ..\r"
+**	  --linefeed        ASCII output with CR LF (ATL1)
+**	  --no-spaces       ASCII output without spaces "XXXX..\r" (ATS0)
+**	  --adapt           measured receive thresholds (ATJ1)
+**	  --skew P          all bus symbols P percent longer, default 0
+**	  --jitter US       uniform noise on every bus symbol, default 0
+**	  --glitches P      P percent of the bus symbols get a spike, default 0
+**	  --glitch-width US spike width, default 0.5
+**	  --glitch-us N     receiver glitch filter (ATJG), default 0 = off
+**	  --frame-cycles N  CPU cycles per decoded frame, default 600
+**	  --char-cycles N   CPU cycles per output character, default 40
+**	  --max-lost P      fail when more than P percent of the frames are lost
+**
+**	A trace of "-" is read from stdin.
+**
+**************************************************************************/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "vpw_sim.h"
+#include "vpw_trace.h"
+
+// firmware driver, see j1850.h
+extern "C" {
+void j1850_init(void);
+uint8_t j1850_recv_msg(uint8_t *msg_buf, bool checkLength);
+extern bool j1850_rx_adapt;
+extern uint16_t j1850_glitch_ticks;
+}
+
+namespace {
+
+const uint8_t code_bus_error = 3;	// J1850_RETURN_CODE_BUS_ERROR
+const unsigned tx_ring_size = 64;	// SERIAL_TX_RING_SIZE in main.h
+
+struct options
+{
+	std::string trace;
+	unsigned baud = 115200;
+	bool packed = false;
+	bool linefeed = false;
+	bool spaces = true;
+	bool adapt = false;
+	vpw::wave_config wave;
+	unsigned glitch_filter_us = 0;
+	unsigned frame_cycles = 600;
+	unsigned char_cycles = 40;
+	double max_lost = 100;
+};
+
+void usage(void)
+{
+	std::fprintf(stderr,
+		"usage: vpw_replay [--baud N] [--packed] [--linefeed] [--no-spaces] [--adapt]\n"
+		"                  [--skew P] [--jitter US] [--glitches P] [--glitch-width US]\n"
+		"                  [--glitch-us N] [--frame-cycles N] [--char-cycles N]\n"
+		"                  [--max-lost P] trace\n");
+	std::exit(2);
+}
+
+options parse_args(int argc, char **argv)
+{
+	options o;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string a = argv[i];
+		auto value = [&]() -> const char * {
+			if(i + 1 >= argc) usage();
+			return argv[++i];
+		};
+
+		if(a == "--baud") o.baud = std::atoi(value());
+		else if(a == "--packed") o.packed = true;
+		else if(a == "--linefeed") o.linefeed = true;
+		else if(a == "--no-spaces") o.spaces = false;
+		else if(a == "--adapt") o.adapt = true;
+		else if(a == "--skew") o.wave.skew = std::atof(value()) / 100;
+		else if(a == "--jitter") o.wave.jitter_us = std::atof(value());
+		else if(a == "--glitches") o.wave.glitch_rate = std::atof(value()) / 100;
+		else if(a == "--glitch-width") o.wave.glitch_us = std::atof(value());
+		else if(a == "--glitch-us") o.glitch_filter_us = std::atoi(value());
+		else if(a == "--frame-cycles") o.frame_cycles = std::atoi(value());
+		else if(a == "--char-cycles") o.char_cycles = std::atoi(value());
+		else if(a == "--max-lost") o.max_lost = std::atof(value());
+		else if(o.trace.empty() && (a == "-" || a[0] != '-')) o.trace = a;
+		else usage();
+	}
+	if(o.trace.empty() || !o.baud) usage();
+	return o;
+}
+
+// Tx ring buffer drained by the UART, chars leave the ring when their start bit goes out
+class uart_model
+{
+public:
+	uart_model(vpw::avr_sim &sim, unsigned baud)
+		: sim_(sim), char_cycles_(sim.cycles(10e6 / baud)) {}
+
+	// like serial_putc(), returns the cycle the char is completely sent
+	uint64_t put()
+	{
+		while(!ring_.empty() && ring_.front() <= sim_.now()) ring_.pop_front();
+		if(ring_.size() >= tx_ring_size - 1)
+		{
+			blocked_ += ring_.front() - sim_.now();
+			sim_.advance_to(ring_.front());
+			ring_.pop_front();
+		}
+		uint64_t start = std::max(sim_.now(), line_free_);
+		ring_.push_back(start);
+		line_free_ = start + char_cycles_;
+		busy_ += char_cycles_;
+		++chars_;
+		return line_free_;
+	}
+
+	uint64_t chars() const { return chars_; }
+	uint64_t busy() const { return busy_; }
+	uint64_t blocked() const { return blocked_; }
+
+private:
+	vpw::avr_sim &sim_;
+	uint64_t char_cycles_;
+	std::deque<uint64_t> ring_;
+	uint64_t line_free_ = 0;
+	uint64_t chars_ = 0, busy_ = 0, blocked_ = 0;
+};
+
+double percentile(std::vector<double> &v, double p)
+{
+	if(v.empty()) return 0;
+	size_t i = std::min(v.size() - 1, static_cast<size_t>(p * v.size()));
+	std::nth_element(v.begin(), v.begin() + i, v.end());
+	return v[i];
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	options o = parse_args(argc, argv);
+	vpw::trace t;
+
+	try
+	{
+		if(o.trace == "-")
+			t = vpw::read_trace(std::cin);
+		else
+		{
+			std::ifstream f(o.trace);
+			if(!f) throw std::runtime_error("cannot open " + o.trace);
+			t = vpw::read_trace(f);
+		}
+	}
+	catch(const std::exception &e)
+	{
+		std::fprintf(stderr, "vpw_replay: %s\n", e.what());
+		return 2;
+	}
+
+	vpw::bus_schedule bus = vpw::schedule(t, o.wave);
+	vpw::avr_sim sim(vpw::avr_sim::config{});
+
+	std::vector<vpw::avr_sim::period> active;
+	for(const auto &p : bus.active) active.emplace_back(sim.cycles(p.first), sim.cycles(p.second));
+	sim.set_bus(std::move(active));
+
+	std::vector<uint64_t> frame_end;
+	for(const vpw::bus_frame &f : bus.frames) frame_end.push_back(sim.cycles(f.end_us));
+	std::vector<bool> seen(bus.frames.size());
+
+	j1850_init();
+	j1850_rx_adapt = o.adapt;
+	j1850_glitch_ticks = sim.cycles(o.glitch_filter_us);	// Timer1 runs at the CPU clock at 7.3728MHz
+
+	uart_model uart(sim, o.baud);
+	std::vector<double> latency;
+	unsigned ok = 0, corrupted = 0, spurious = 0, bus_errors = 0;
+	uint64_t stop = (frame_end.empty() ? 0 : frame_end.back()) + sim.cycles(2000);
+	uint64_t match_window = sim.cycles(1000);
+	size_t next = 0;	// first frame not ended yet
+	auto wall = std::chrono::steady_clock::now();
+
+	while(sim.now() < stop)
+	{
+		uint8_t buf[128];
+		uint8_t n = j1850_recv_msg(buf, false);
+
+		if(n & 0x80)
+		{
+			if((n & 0x7F) == code_bus_error) ++bus_errors;
+			continue;
+		}
+		if(!n) continue;
+
+		// the decoded frame is the one that ended last
+		while(next < frame_end.size() && frame_end[next] <= sim.now()) ++next;
+		size_t i = next - 1;
+		bool match = next && !seen[i] && sim.now() - frame_end[i] < match_window;
+		if(!match)
+			++spurious;
+		else
+		{
+			seen[i] = true;
+			if(std::vector<uint8_t>(buf, buf + n) == bus.frames[i].bytes) ++ok;
+			else ++corrupted;
+		}
+
+		// monitor_output()
+		sim.advance(o.frame_cycles);
+		unsigned chars = o.packed ? n + 1 : (o.spaces ? 3 : 2) * n + 1 + o.linefeed;
+		uint64_t sent = 0;
+		while(chars--)
+		{
+			sim.advance(o.char_cycles);
+			sent = uart.put();
+		}
+		if(match) latency.push_back(sim.us(sent - frame_end[i]) / 1000);
+	}
+
+	double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+	double sim_s = sim.us(sim.now()) / 1e6;
+	unsigned expected = bus.frames.size();
+	unsigned lost = expected - ok - corrupted;
+	double lost_pct = expected ? 100.0 * lost / expected : 0;
+
+	std::printf("trace: %u frames, %.3f s, bus load %.1f%%, %u collisions\n",
+				expected, sim_s, 100 * bus.busy_us / (sim_s * 1e6), bus.collisions);
+	std::printf("decoded: %u ok, %u corrupted, %u lost (%.2f%%), %u spurious, %u bus errors, %.1f frames/s\n",
+				ok, corrupted, lost, lost_pct, spurious, bus_errors, ok / sim_s);
+	std::printf("serial: %u baud %s, %llu chars, line busy %.1f%%, main loop blocked %.1f%%\n",
+				o.baud, o.packed ? "packed" : o.spaces ? "ascii" : "ascii no spaces", (unsigned long long)uart.chars(),
+				100.0 * uart.busy() / sim.now(), 100.0 * uart.blocked() / sim.now());
+	std::printf("latency: p50 %.2f ms p95 %.2f ms p99 %.2f ms max %.2f ms\n",
+				percentile(latency, 0.50), percentile(latency, 0.95), percentile(latency, 0.99),
+				latency.empty() ? 0 : *std::max_element(latency.begin(), latency.end()));
+	std::printf("host: %.2f s for %.2f s simulated\n", wall_s, sim_s);
+
+	return lost_pct > o.max_lost ? 1 : 0;
+}
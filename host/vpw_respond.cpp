@@ -0,0 +1,154 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Request and response through j1850_send_recv() on the simulated
+**	ATmega of vpw_sim.h. The firmware sends a request, a simulated ECU
+**	starts its response SOF a fixed IFS after the end of our last data
+**	symbol, and the frame returned by the driver must match the response
+**	with a correct CRC. At the minimum IFS the response begins while the
+**	driver still times our EOF, the case the receiver must not miss.
+**
+**	vpw_respond [options]
+**	  --ifs US          ECU response SOF after our frame end, default 280
+**	                    (RX_IFS_MIN)
+**	  --skew P          all ECU symbols P percent longer, default 0
+**	  --count N         request/response exchanges, default 10
+**	  --release-us US   transceiver release edge of our output, default 15
+**
+**************************************************************************/
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "vpw_sim.h"
+#include "vpw_trace.h"
+
+// firmware driver, see j1850.h
+extern "C" {
+void j1850_init(void);
+uint8_t j1850_send_recv(uint8_t *msg_buf, int8_t nbytes, bool checkLength, uint8_t *recv_nbytes);
+}
+
+namespace {
+
+const uint8_t code_ok = 1;	// J1850_RETURN_CODE_OK
+
+struct options
+{
+	double ifs_us = 280;
+	vpw::wave_config wave;
+	unsigned count = 10;
+	vpw::avr_sim::config sim;
+};
+
+void usage(void)
+{
+	std::fprintf(stderr, "usage: vpw_respond [--ifs US] [--skew P] [--count N] [--release-us US]\n");
+	std::exit(2);
+}
+
+options parse_args(int argc, char **argv)
+{
+	options o;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string a = argv[i];
+		auto value = [&]() -> const char * {
+			if(i + 1 >= argc) usage();
+			return argv[++i];
+		};
+
+		if(a == "--ifs") o.ifs_us = std::atof(value());
+		else if(a == "--skew") o.wave.skew = std::atof(value()) / 100;
+		else if(a == "--count") o.count = std::atoi(value());
+		else if(a == "--release-us") o.sim.release_us = std::atof(value());
+		else usage();
+	}
+	if(!o.count) usage();
+	return o;
+}
+
+std::vector<uint8_t> with_crc(std::vector<uint8_t> bytes)
+{
+	bytes.push_back(vpw::crc(bytes.data(), bytes.size()));
+	return bytes;
+}
+
+void print_frame(const char *what, const uint8_t *p, size_t n)
+{
+	std::printf("%s:", what);
+	while(n--) std::printf(" %02X", *p++);
+	std::printf("\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	options o = parse_args(argc, argv);
+	vpw::avr_sim sim(o.sim);
+	std::vector<uint8_t> response;
+
+	// every release of our output moves the answer, the one after the last data symbol stays
+	sim.on_release([&](uint64_t cycle) {
+		vpw::bus_schedule bus = vpw::schedule({ { 0, response } }, o.wave);
+		double sof_us = bus.frames.front().sof_us;
+		uint64_t start = cycle + sim.cycles(o.ifs_us);
+		std::vector<vpw::avr_sim::period> answer;
+		for(const auto &p : bus.active)
+			answer.emplace_back(start + sim.cycles(p.first - sof_us), start + sim.cycles(p.second - sof_us));
+		sim.set_bus(std::move(answer));
+	});
+
+	j1850_init();
+
+	unsigned ok = 0, wrong = 0, crc_errors = 0, failed = 0;
+	for(unsigned i = 0; i < o.count; ++i)
+	{
+		uint8_t pid = static_cast<uint8_t>(i);
+		std::vector<uint8_t> request = with_crc({ 0x68, 0x6A, 0xF1, 0x01, pid });
+		response = with_crc({ 0x48, 0x6B, 0x10, 0x41, pid, static_cast<uint8_t>(0x1A + i), 0xF8 });
+
+		uint8_t buf[16] = {};
+		std::copy(request.begin(), request.end(), buf);
+		uint8_t recv_nbytes = 0;
+		uint8_t rc = j1850_send_recv(buf, request.size(), true, &recv_nbytes);
+
+		if(rc != code_ok || (recv_nbytes & 0x80))
+		{
+			std::printf("exchange %u: send 0x%02X, receive 0x%02X\n", i, rc, recv_nbytes);
+			++failed;
+		}
+		else if(std::vector<uint8_t>(buf, buf + recv_nbytes) != response)
+		{
+			print_frame("expected", response.data(), response.size());
+			print_frame("received", buf, recv_nbytes);
+			++wrong;
+		}
+		else if(vpw::crc(buf, recv_nbytes - 1) != buf[recv_nbytes - 1])
+			++crc_errors;
+		else
+			++ok;
+
+		sim.set_bus({});
+		sim.advance(sim.cycles(5000));	// serial output of the caller, bus idle again
+	}
+
+	std::printf("send_recv: %u exchanges, ECU SOF %.1f us after our frame end, skew %+.1f%%, release %.1f us\n",
+				o.count, o.ifs_us, 100 * o.wave.skew, o.sim.release_us);
+	std::printf("responses: %u ok, %u wrong, %u crc errors, %u failed\n", ok, wrong, crc_errors, failed);
+
+	return ok == o.count ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**                              + release hook, a simulated node can answer our frame
+**                              + transceiver release delay of our output
+**
+**************************************************************************/
+#include <stdexcept>
+#include "vpw_sim.h"
+#include "sim/avr/io.h"
+
+// Timer0 overflow counters of the driver, normally kept by its ISR
+extern "C" volatile uint8_t time_base_high, time_base_upper;
+
+namespace vpw {
+
+static avr_sim *current;
+
+static const unsigned bus_in = 0;		// J1850_PIN_IN, input inverted by hardware
+static const unsigned bus_out = 3;		// J1850_PIN_OUT, output inverted by hardware
+
+avr_sim::avr_sim(const config &cfg)
+	: cfg_(cfg)
+{
+	if(current) throw std::logic_error("one avr_sim per process");
+	current = this;
+	regs_[SIM_PINC] = last_[SIM_PINC] = 0xFF;
+}
+
+avr_sim::~avr_sim()
+{
+	current = nullptr;
+}
+
+void avr_sim::set_bus(std::vector<period> active)
+{
+	bus_ = std::move(active);
+	bus_pos_ = 0;
+}
+
+bool avr_sim::bus_active()
+{
+	while(bus_pos_ < bus_.size() && bus_[bus_pos_].second <= cycles_) ++bus_pos_;
+	if(bus_pos_ < bus_.size() && bus_[bus_pos_].first <= cycles_) return true;
+
+	return output_active();
+}
+
+// our own output, active low when driven
+bool avr_sim::output_driven() const
+{
+	return (last_[SIM_DDRC] & _BV(bus_out)) && !(last_[SIM_PORTC] & _BV(bus_out));
+}
+
+// level of our output on the bus, still active during the release edge
+bool avr_sim::output_active() const
+{
+	return output_driven() || cycles_ < release_end_;
+}
+
+uint16_t avr_sim::timer1_value() const
+{
+	if(!timer1_prescaler_) return timer1_start_;
+	return static_cast<uint16_t>(timer1_start_ + (cycles_ - timer1_base_) / timer1_prescaler_);
+}
+
+// pick up what the driver wrote since the last access
+void avr_sim::sync()
+{
+	bool driven = output_driven();
+	for(unsigned r = 0; r < SIM_REG_COUNT; ++r)
+		if(regs_[r] != last_[r]) last_[r] = regs_[r];
+	if(driven && !output_driven())
+	{
+		release_end_ = cycles_ + cycles(cfg_.release_us);
+		if(release_) release_(cycles_);
+	}
+
+	if(tcnt1_ != tcnt1_last_)
+	{
+		timer1_start_ = tcnt1_last_ = tcnt1_;
+		timer1_base_ = cycles_;
+	}
+
+	static const unsigned prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	unsigned p = prescaler[last_[SIM_TCCR1B] & 0x07];
+	if(p != timer1_prescaler_)
+	{
+		timer1_start_ = timer1_value();
+		timer1_base_ = cycles_;
+		timer1_prescaler_ = p;
+	}
+}
+
+volatile uint8_t *avr_sim::reg8(unsigned reg)
+{
+	sync();
+	cycles_ += cfg_.access_cycles;
+
+	switch(reg)
+	{
+		case SIM_PINC:
+			last_[reg] = bus_active() ? static_cast<uint8_t>(~_BV(bus_in)) : 0xFF;
+			break;
+		case SIM_TCNT0:
+			last_[reg] = static_cast<uint8_t>(cycles_ >> 8);	// clk/256
+			break;
+		case SIM_TIFR:
+			last_[reg] = 0;	// overflows are always serviced
+			break;
+	}
+	time_base_high = static_cast<uint8_t>(cycles_ >> 16);
+	time_base_upper = static_cast<uint8_t>(cycles_ >> 24);
+
+	regs_[reg] = last_[reg];
+	return &regs_[reg];
+}
+
+volatile uint16_t *avr_sim::tcnt1()
+{
+	sync();
+	cycles_ += cfg_.access_cycles;
+	tcnt1_ = tcnt1_last_ = timer1_value();
+	return &tcnt1_;
+}
+
+} // namespace vpw
+
+extern "C" volatile uint8_t *sim_reg8(enum sim_reg reg)
+{
+	return vpw::current->reg8(reg);
+}
+
+extern "C" volatile uint16_t *sim_tcnt1(void)
+{
+	return vpw::current->tcnt1();
+}
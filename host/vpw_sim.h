@@ -0,0 +1,95 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**                              + release hook, a simulated node can answer our frame
+**                              + transceiver release delay of our output
+**
+**	Cycle counting model of the ATmega around the firmware J1850 driver.
+**	src/j1850.c is compiled against sim/avr/io.h, each register access
+**	costs a fixed number of CPU cycles and the bus input follows a list
+**	of active periods. Timing is approximate, close enough to find the
+**	load where frames start to get lost, not to replace a logic analyzer.
+**
+**	The driver keeps its state in globals, so there is one simulator per
+**	process.
+**
+**************************************************************************/
+#ifndef __VPW_SIM_H__
+#define __VPW_SIM_H__
+
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace vpw {
+
+class avr_sim
+{
+public:
+	using period = std::pair<uint64_t, uint64_t>;	// bus active from first to second cycle
+	using release_hook = std::function<void(uint64_t)>;	// cycle where our output stopped driving the bus
+
+	struct config
+	{
+		uint32_t xtal = 7372800;	// must match MCU_XTAL of the driver build
+		unsigned access_cycles = 4;	// CPU cycles per register access
+		double release_us = 15;		// input still reads our active level after release, slew limited edge
+	};
+
+	explicit avr_sim(const config &cfg);
+	~avr_sim();
+
+	avr_sim(const avr_sim &) = delete;
+	avr_sim &operator=(const avr_sim &) = delete;
+
+	void set_bus(std::vector<period> active);	// sorted, not overlapping
+	void on_release(release_hook hook) { release_ = std::move(hook); }	// may call set_bus()
+
+	uint64_t now() const { return cycles_; }
+	void advance(uint64_t cycles) { cycles_ += cycles; }	// code outside the driver
+	void advance_to(uint64_t cycle) { if(cycle > cycles_) cycles_ = cycle; }
+
+	uint64_t cycles(double us) const { return static_cast<uint64_t>(us * cfg_.xtal / 1e6 + 0.5); }
+	double us(uint64_t cycles) const { return cycles * 1e6 / cfg_.xtal; }
+
+	// register access from the sim/avr/io.h shim
+	volatile uint8_t *reg8(unsigned reg);
+	volatile uint16_t *tcnt1();
+
+private:
+	void sync();
+	bool bus_active();
+	bool output_driven() const;
+	bool output_active() const;
+	uint16_t timer1_value() const;
+
+	config cfg_;
+	uint64_t cycles_ = 0;
+	std::vector<period> bus_;
+	size_t bus_pos_ = 0;
+	release_hook release_;
+	uint64_t release_end_ = 0;			// cycle where our last release edge has passed
+
+	volatile uint8_t regs_[16] = {};	// shadow registers handed to the driver
+	uint8_t last_[16] = {};				// value of the last access, a difference is a write
+	volatile uint16_t tcnt1_ = 0;
+	uint16_t tcnt1_last_ = 0;
+
+	unsigned timer1_prescaler_ = 0;		// 0 = stopped
+	uint64_t timer1_base_ = 0;			// cycle where the count was timer1_start_
+	uint16_t timer1_start_ = 0;
+};
+
+} // namespace vpw
+
+#endif // __VPW_SIM_H__
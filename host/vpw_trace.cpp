@@ -0,0 +1,224 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**************************************************************************/
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "vpw_trace.h"
+
+namespace vpw {
+
+namespace {
+
+// nominal VPW symbols in us, see TX_* in j1850.h
+const double sym_sof = 200;
+const double sym_short = 64;
+const double sym_long = 128;
+const double sym_ifs = 300;
+
+// bus time of a frame from SOF to the end of its last data symbol
+double frame_us(const std::vector<uint8_t> &bytes)
+{
+	double t = sym_sof;
+
+	for(size_t i = 0; i < bytes.size() * 8; ++i)
+	{
+		bool one = bytes[i / 8] & (0x80 >> (i % 8));
+		bool active = i & 1;	// first bit after SOF is passive
+		t += (one != active) ? sym_long : sym_short;
+	}
+	return t;
+}
+
+} // namespace
+
+uint8_t crc(const uint8_t *p, size_t n)
+{
+	uint8_t reg = 0xFF;
+
+	while(n--)
+	{
+		for(uint8_t bit = 0x80; bit; bit >>= 1)
+		{
+			if(*p & bit)
+				reg = ((reg << 1) | 1) ^ ((reg & 0x80) ? 0x01 : 0x1C);
+			else
+				reg = (reg << 1) ^ ((reg & 0x80) ? 0x1D : 0x00);
+		}
+		++p;
+	}
+	return ~reg;
+}
+
+trace read_trace(std::istream &in)
+{
+	trace t;
+	std::string line;
+
+	for(unsigned n = 1; std::getline(in, line); ++n)
+	{
+		std::istringstream s(line);
+		std::string tok;
+		trace_frame f;
+
+		if(!(s >> tok) || tok[0] == '#') continue;
+		try
+		{
+			size_t end;
+			f.time_us = std::stod(tok, &end);
+			if(end != tok.size()) throw std::invalid_argument(tok);
+			while(s >> tok)
+			{
+				if(tok.size() != 2 || !isxdigit(tok[0]) || !isxdigit(tok[1])) throw std::invalid_argument(tok);
+				f.bytes.push_back(std::stoi(tok, nullptr, 16));
+			}
+		}
+		catch(const std::logic_error &)
+		{
+			throw std::runtime_error("trace line " + std::to_string(n) + ": syntax error");
+		}
+		if(f.bytes.empty()) throw std::runtime_error("trace line " + std::to_string(n) + ": no frame bytes");
+		t.push_back(std::move(f));
+	}
+	return t;
+}
+
+void write_trace(std::ostream &out, const trace &t)
+{
+	char num[32];
+
+	out << "# vpw-trace 1\n";
+	for(const trace_frame &f : t)
+	{
+		std::snprintf(num, sizeof(num), "%.1f", f.time_us);
+		out << num;
+		for(uint8_t b : f.bytes)
+		{
+			std::snprintf(num, sizeof(num), " %02X", b);
+			out << num;
+		}
+		out << '\n';
+	}
+}
+
+trace make_corpus(const corpus_config &cfg)
+{
+	static const uint8_t priority[] = { 0x48, 0x68, 0x88, 0xA8, 0xC8, 0xE8 };
+	static const uint8_t node[] = { 0x10, 0x18, 0x28, 0x40, 0x58, 0x6A, 0xF1 };
+
+	std::mt19937 rng(cfg.seed);
+	auto pick = [&](unsigned n) { return static_cast<unsigned>(rng() % n); };
+	auto make_frame = [&]() {
+		std::vector<uint8_t> f;
+		if(cfg.one_byte_header)
+			f.push_back(pick(256));
+		else
+			f = { priority[pick(sizeof(priority))], node[pick(sizeof(node))], node[pick(sizeof(node))] };
+		for(unsigned n = 1 + pick(7); n; --n) f.push_back(pick(256));
+		f.push_back(crc(f.data(), f.size()));
+		return f;
+	};
+
+	trace t;
+	double load = std::min(std::max(cfg.load, 0.01), 0.95);
+	double next_burst = 100000;
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	for(double now = 0; now < cfg.seconds * 1e6; )
+	{
+		if(cfg.burst && now >= next_burst)
+		{	// one node sends a block of frames, they follow each other with the minimum IFS
+			for(unsigned i = 0; i < cfg.burst; ++i) t.push_back({ next_burst + i, make_frame() });
+			next_burst += 100000;
+		}
+
+		trace_frame f = { now, make_frame() };
+		if(uniform(rng) < cfg.collide)
+			t.push_back({ now, make_frame() });	// second node starts at the same time
+		double len = frame_us(f.bytes);
+		t.push_back(std::move(f));
+
+		// exponential gaps, mean chosen for the requested share of bus time
+		now += -std::log(1 - uniform(rng)) * (len + sym_ifs) / load;
+	}
+	std::stable_sort(t.begin(), t.end(), [](const trace_frame &a, const trace_frame &b) { return a.time_us < b.time_us; });
+	return t;
+}
+
+bus_schedule schedule(const trace &t, const wave_config &cfg)
+{
+	bus_schedule s;
+	std::mt19937 rng(cfg.seed);
+	std::uniform_real_distribution<double> jitter(-cfg.jitter_us, cfg.jitter_us);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	auto symbol = [&](double us) { return std::max(1.0, us * (1 + cfg.skew) + (cfg.jitter_us > 0 ? jitter(rng) : 0)); };
+
+	trace pending = t;
+	std::stable_sort(pending.begin(), pending.end(), [](const trace_frame &a, const trace_frame &b) { return a.time_us < b.time_us; });
+
+	double idle_at = 0;
+	while(!pending.empty())
+	{
+		// frames asking for the same time start together, the lowest bit stream wins arbitration
+		size_t winner = 0, last = 1;
+		for(; last < pending.size() && pending[last].time_us == pending[0].time_us; ++last)
+			if(pending[last].bytes < pending[winner].bytes) winner = last;
+		if(last > 1) ++s.collisions;
+
+		bus_frame f;
+		f.bytes = pending[winner].bytes;
+		f.sof_us = std::max(pending[0].time_us, idle_at);
+
+		double now = f.sof_us + symbol(sym_sof);
+		s.active.emplace_back(f.sof_us, now);
+		for(size_t i = 0; i < f.bytes.size() * 8; ++i)
+		{
+			bool one = f.bytes[i / 8] & (0x80 >> (i % 8));
+			bool active = i & 1;
+			double end = now + symbol((one != active) ? sym_long : sym_short);
+			double spike = -1;
+			if(cfg.glitch_rate > 0 && uniform(rng) < cfg.glitch_rate)
+				spike = now + uniform(rng) * (end - now - cfg.glitch_us);
+			if(spike < now)
+			{
+				if(active) s.active.emplace_back(now, end);
+			}
+			else if(active)
+			{	// short passive gap inside the active symbol
+				s.active.emplace_back(now, spike);
+				s.active.emplace_back(spike + cfg.glitch_us, end);
+			}
+			else
+				s.active.emplace_back(spike, spike + cfg.glitch_us);
+			now = end;
+		}
+		f.end_us = now;
+		s.busy_us += f.end_us - f.sof_us;
+		idle_at = now + sym_ifs;
+
+		// losers keep their time and contend again at the next idle bus
+		pending.erase(pending.begin() + winner);
+		s.frames.push_back(std::move(f));
+	}
+	return s;
+}
+
+} // namespace vpw
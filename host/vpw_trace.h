@@ -0,0 +1,95 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Bus traffic traces and their VPW waveform.
+**
+**	A trace is a text file, one frame per line:
+**
+**	  # vpw-trace 1
+**	  <time us> <frame bytes in hex, CRC included>
+**	  12500.0 68 6A F1 01 00 17
+**
+**	The time is when the node wants to send, the frame goes out after the
+**	bus is idle for an IFS. Lines starting with '#' are comments. Captures
+**	from a logic analyzer or ATMA output with time stamps convert easily.
+**
+**	make_corpus() builds synthetic traces, schedule() turns a trace into
+**	the pulse train seen on the bus including arbitration between frames
+**	that start together.
+**
+**************************************************************************/
+#ifndef __VPW_TRACE_H__
+#define __VPW_TRACE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <utility>
+#include <vector>
+
+namespace vpw {
+
+struct trace_frame
+{
+	double time_us;
+	std::vector<uint8_t> bytes;
+};
+
+using trace = std::vector<trace_frame>;
+
+trace read_trace(std::istream &in);	// throws std::runtime_error with the line number
+void write_trace(std::ostream &out, const trace &t);
+
+uint8_t crc(const uint8_t *p, size_t n);	// same algorithm as j1850_crc() in the firmware
+
+struct corpus_config
+{
+	double seconds = 10;
+	double load = 0.3;		// share of bus time used by frames, 0..1
+	unsigned burst = 0;		// frames sent back to back every 100ms, 0 = none
+	double collide = 0;		// share of frames started together with another node
+	bool one_byte_header = false;	// 1 byte headers (older GM), default 3 bytes
+	unsigned seed = 1;
+};
+
+trace make_corpus(const corpus_config &cfg);
+
+struct wave_config
+{
+	double skew = 0;		// all symbols longer (+) or shorter (-), 0.05 = 5%
+	double jitter_us = 0;	// uniform noise on every symbol
+	double glitch_rate = 0;	// share of symbols with a spike of the other state inside
+	double glitch_us = 0.5;	// spike width
+	unsigned seed = 1;
+};
+
+struct bus_frame
+{
+	std::vector<uint8_t> bytes;
+	double sof_us;			// start of SOF
+	double end_us;			// end of the last data symbol
+};
+
+struct bus_schedule
+{
+	std::vector<std::pair<double, double>> active;	// active symbols, start and end in us
+	std::vector<bus_frame> frames;	// frames in bus order
+	unsigned collisions = 0;	// arbitrations, the loser is sent again afterwards
+	double busy_us = 0;		// SOF to end of frame, summed
+};
+
+bus_schedule schedule(const trace &t, const wave_config &cfg);
+
+} // namespace vpw
+
+#endif // __VPW_TRACE_H__
@@ -0,0 +1,67 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface - Linux host library
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release
+**
+**	Synthetic bus traffic corpus in the vpw-trace format, see vpw_trace.h.
+**
+**	vpw_tracegen [options] > corpus.trace
+**	  --seconds S       length of the trace, default 10
+**	  --load P          percent of bus time used by frames, default 30
+**	  --burst N         N frames back to back every 100ms, default 0
+**	  --collide P       percent of frames started together with another, default 0
+**	  --profile NAME    gm (3 byte headers, default) or pci (1 byte headers)
+**	  --seed N          random seed, default 1
+**
+**************************************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "vpw_trace.h"
+
+static void usage(void)
+{
+	std::fprintf(stderr,
+		"usage: vpw_tracegen [--seconds S] [--load P] [--burst N] [--collide P]\n"
+		"                    [--profile gm|pci] [--seed N]\n");
+	std::exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	vpw::corpus_config cfg;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		std::string a = argv[i];
+		auto value = [&]() -> const char * {
+			if(i + 1 >= argc) usage();
+			return argv[++i];
+		};
+
+		if(a == "--seconds") cfg.seconds = std::atof(value());
+		else if(a == "--load") cfg.load = std::atof(value()) / 100;
+		else if(a == "--burst") cfg.burst = std::atoi(value());
+		else if(a == "--collide") cfg.collide = std::atof(value()) / 100;
+		else if(a == "--profile")
+		{
+			std::string p = value();
+			if(p == "pci") cfg.one_byte_header = true;
+			else if(p != "gm") usage();
+		}
+		else if(a == "--seed") cfg.seed = std::atoi(value());
+		else usage();
+	}
+
+	vpw::write_trace(std::cout, vpw::make_corpus(cfg));
+	return std::cout ? 0 : 1;
+}
@@ -23,6 +23,21 @@
 **	10/10/06     v1.06 Michael	* changed timeout in j1850_recv_msg() back to 100us
 **	08/09/10     v1.07 Michael  * fix an possible issue with TCNT1 when code is ported
 **  10/07/21     v1.09 Remi S   * j1850 send and receive functions now support parameter for checking or not message length
+**  19/10/26     v1.10 Remi S   + receive and send update the statistics counters, CRC is checked while receiving
+**                              + added Timer0 time base, receive stamps the frame start
+**                              + added j1850_send_recv(), receiver runs right after our EOF
+**                              + compile time checks of the timing for MCU_XTAL
+**                              + added second channel, receive can wait on both channels
+**                              + Timer0 overflow also counts the coarse time base
+**                              + receive measures symbol timing per transmitter, thresholds can follow it
+**                              * fixed receive length limit, was never reached because of operator precedence
+**                              * Timer0 registers and vector from mcu.h, builds for ATmega32 and ATmega328P
+**                              + receive ignores spikes shorter than j1850_glitch_ticks, symbols are timed from the edge
+**                              * fixed send collision check, never true because of operator precedence
+**                              * send collision check watches the selected channel
+**                              * symbol timing skips one byte header frames, they carry no source address
+**                              * send collision check waits TX_SETTLE for our release edge
+**                              * receive counts the idle time before an SOF, not only timeouts
 **
 **	NOTE:
 **	This file is based on code from Bruce D. Lightner.
@@ -33,8 +48,26 @@
 **	deprecated macros to be compatible with the latest version of WinAVR.
 **************************************************************************/
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdbool.h>
 #include "j1850.h"
+
+// timing must be representable in Timer1 ticks and every symbol distinguishable
+_Static_assert(us2cnt_raw(TIMER1_LONGEST_US) <= 0xFFFF, "MCU_XTAL too fast, Timer1 overflows");
+_Static_assert(RX_SHORT_MIN >= J1850_TICKS_MIN, "MCU_XTAL too slow to resolve short pulses");
+_Static_assert(RX_SHORT_MIN < TX_SHORT && TX_SHORT < RX_SHORT_MAX, "short pulse window");
+_Static_assert(TX_SETTLE < RX_SHORT_MIN, "collision check must start before a short pulse ends");
+_Static_assert(RX_SHORT_MAX <= RX_LONG_MIN, "short and long pulse windows overlap");
+_Static_assert(RX_LONG_MIN < TX_LONG && TX_LONG < RX_LONG_MAX, "long pulse window");
+_Static_assert(RX_LONG_MAX <= RX_SOF_MIN, "long pulse and SOF windows overlap");
+_Static_assert(RX_LONG_MAX == RX_EOD_MIN, "one threshold ends long pulses and detects EOD");
+_Static_assert(RX_SOF_MIN < TX_SOF && TX_SOF < RX_SOF_MAX, "SOF window");
+_Static_assert(RX_EOD_MIN < TX_EOD && TX_EOD < RX_EOD_MAX, "EOD window");
+_Static_assert(RX_EOD_MAX <= RX_EOF_MIN && RX_EOF_MIN <= TX_EOF, "EOF window");
+_Static_assert(RX_EOF_MIN < RX_IFS_MIN && RX_IFS_MIN <= TX_IFS, "IFS window");
+_Static_assert(RX_BRK_MIN <= TX_BRK, "break window");
+_Static_assert(RX_IFS_MIN < WAIT_100us, "receive timeout shorter than IFS");
+
 /* 
 **--------------------------------------------------------------------------- 
 ** 
@@ -53,7 +86,63 @@ void j1850_init(void)
 	
 	J1850_PULLUP_IN |= _BV(J1850_PIN_IN);	// enable pull-up on VPW pin
 	J1850_DIR_IN	&=~ _BV(J1850_PIN_IN);	// make VPW input pin an input
-  
+
+#if J1850_CHANNELS > 1
+	#ifdef J1850_PIN_OUT_NEG
+	J1850_PORT_OUT |= _BV(J1850_PIN_OUT_B);	// second channel passive
+	#else
+	J1850_PORT_OUT &=~ _BV(J1850_PIN_OUT_B);
+	#endif
+	J1850_DIR_OUT |= _BV(J1850_PIN_OUT_B);
+	J1850_PULLUP_IN |= _BV(J1850_PIN_IN_B);
+	J1850_DIR_IN	&=~ _BV(J1850_PIN_IN_B);
+	j1850_select(0);
+#endif
+
+	TIMER0_TCCR = c_start_time_base;	// start time base
+	TIMER0_TIMSK |= _BV(TOIE0);	// enable Timer0 overflow interrupt
+
+	j1850_glitch_ticks = us2cnt(J1850_GLITCH_US);
+}
+
+#if J1850_CHANNELS > 1
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Select the J1850 channel used by send and receive, the
+**           receiver listens on this channel only
+** 
+** Parameters: 0 = first channel, 1 = second channel
+** 
+** Returns: none
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+void j1850_select(uint8_t channel)
+{
+	j1850_channel = channel;
+	j1850_in_mask = channel ? _BV(J1850_PIN_IN_B) : _BV(J1850_PIN_IN);
+	j1850_out_mask = channel ? _BV(J1850_PIN_OUT_B) : _BV(J1850_PIN_OUT);
+	j1850_listen_mask = j1850_in_mask;
+}
+#endif
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Timer0 overflow interrupt, extends the time base to 16 bit
+**           and counts the coarse time base
+** 
+** Parameters: none
+** 
+** Returns: none
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+/* Timer0 Overflow */
+ISR(VECTOR_TIMER0_OVF)
+{
+	if( !++time_base_high ) ++time_base_upper;
 }
 
 
@@ -78,6 +167,160 @@ static void j1850_wait_idle(void)
 }
 
 
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Add bus time to the statistics, keep the active/idle ratio
+**           when the counters get large
+** 
+** Parameters: Timer1 ticks bus active, Timer1 ticks bus idle
+** 
+** Returns: none
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static void j1850_bus_time(uint32_t active, uint16_t idle)
+{
+	stats.bus_active += active;
+	stats.bus_idle += idle;
+	if( (stats.bus_active | stats.bus_idle) & 0x80000000UL )
+	{
+		stats.bus_active >>= 1;
+		stats.bus_idle >>= 1;
+	}
+}
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Update CRC register with one byte, see j1850_crc()
+** 
+** Parameters: CRC register, new byte
+** 
+** Returns: CRC register
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static inline uint8_t j1850_crc_step(uint8_t crc_reg, uint8_t val)
+{
+	for(uint8_t bit_point = 0x80; bit_point; bit_point >>= 1)
+	{
+		if(val & bit_point)
+			crc_reg = ((crc_reg << 1) | 1) ^ ((crc_reg & 0x80) ? 0x01 : 0x1c);
+		else
+			crc_reg = (crc_reg << 1) ^ ((crc_reg & 0x80) ? 0x1d : 0x00);
+	}
+	return crc_reg;
+}
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Find the measured timing of a transmitter
+** 
+** Parameters: transmitter address
+** 
+** Returns: pointer to the entry, NULL if not measured yet
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static rx_timing_t *rx_timing_find(uint8_t addr)
+{
+	for(rx_timing_t *t = rx_timing; t < &rx_timing[RX_TIMING_TARGETS]; ++t)
+		if( t->frames && (t->addr == addr) ) return t;
+	return 0;
+}
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Add the pulse widths of a good frame to the running averages
+**           of its transmitter, 1/8 weight, and derive the thresholds
+** 
+** Parameters: transmitter address, sum of RX_TIMING_SAMPLES short and
+**             long pulses, SOF width, all in Timer1 ticks
+** 
+** Returns: none
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static void rx_timing_add(uint8_t addr, uint16_t short_sum, uint16_t long_sum, uint16_t sof)
+{
+	rx_timing_t *t = rx_timing_find(addr);
+	uint16_t short_avg = short_sum / RX_TIMING_SAMPLES;  // shift only, no time for a division before the next SOF
+	uint16_t long_avg = long_sum / RX_TIMING_SAMPLES;
+
+	if( !t )
+	{
+		for(t = rx_timing; t->frames; )
+			if( ++t >= &rx_timing[RX_TIMING_TARGETS] ) return;  // table full
+		t->addr = addr;
+		t->short_avg = short_avg;
+		t->long_avg = long_avg;
+		t->sof_avg = sof;
+	}
+	else
+	{
+		t->short_avg += ((int16_t)(short_avg - t->short_avg)) / 8;
+		t->long_avg += ((int16_t)(long_avg - t->long_avg)) / 8;
+		t->sof_avg += ((int16_t)(sof - t->sof_avg)) / 8;
+	}
+	if( t->frames < 255 ) ++t->frames;
+
+	t->short_max = (t->short_avg + t->long_avg) / 2;
+	t->long_max = (t->long_avg + t->sof_avg) / 2;
+}
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Check an edge against the glitch filter, the bus has to stay
+**           in its new state for j1850_glitch_ticks. A return to the old
+**           state within that time is a glitch, counted and ignored.
+** 
+** Parameters: bus state before the edge, Timer1 count at the edge
+** 
+** Returns: true for a glitch, false for a real edge
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static inline bool j1850_glitch(uint8_t state, uint16_t edge)
+{
+	while( (uint16_t)(TCNT1 - edge) < j1850_glitch_ticks )
+	{
+		if( is_j1850_active() == state )
+		{
+			++stats.glitches;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Count a received frame, the CRC register ran over all bytes
+** 
+** Parameters: number of received bytes, CRC register, Timer1 ticks of frame,
+**             glitches ignored in this frame
+** 
+** Returns: number of received bytes
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+static uint8_t j1850_recv_done(uint8_t nbytes, uint8_t crc_reg, uint32_t frame_ticks, bool glitched)
+{
+	if(nbytes)
+	{
+		++stats.rx_frames;
+		if(crc_reg != J1850_CRC_RESIDUE) ++stats.crc_errors;
+		else if(glitched) ++stats.glitch_saves;
+	}
+	j1850_bus_time(frame_ticks, 0);
+	return nbytes;
+}
+
 /* 
 **--------------------------------------------------------------------------- 
 ** 
@@ -95,70 +338,138 @@ uint8_t j1850_recv_msg(uint8_t *msg_buf, bool checkLength)
 	uint8_t nbits;			// bit position counter within a byte
 	uint8_t nbytes;		// number of received bytes
 	uint8_t bit_state;// used to compare bit state, active or passive
+	uint8_t crc_reg = 0xFF;  // CRC over received bytes, see j1850_crc()
+	uint32_t frame_ticks;  // bus time of this frame
+	uint8_t *frame = msg_buf;  // frame start, header for the timing measurement
+	uint16_t short_max = RX_SHORT_MAX;  // short/long decision, see rx_timing_t
+	uint16_t long_max = RX_LONG_MAX;  // long/EOD decision
+	uint16_t short_sum = 0, long_sum = 0;  // widths of the first RX_TIMING_SAMPLES pulses of this frame
+	uint8_t short_cnt = 0, long_cnt = 0;
+	uint16_t sof;  // SOF width
+	uint16_t edge;  // Timer1 count at the last edge
+	uint16_t glitches;  // glitch counter at SOF
 	/*
 		wait for responds
 	*/
 
 	timer1_start();	
-	while(!is_j1850_active())	// run as long bus is passive (IDLE)
+	for(;;)
 	{
-		if(TCNT1 >= WAIT_100us)	// check for 100us
+		while(!is_j1850_listen_active())	// run as long bus is passive (IDLE)
 		{
-			timer1_stop();
-			return J1850_RETURN_CODE_NO_DATA | 0x80;	// error, no responds within 100us
+			if(TCNT1 >= WAIT_100us)	// check for 100us
+			{
+				timer1_stop();
+				j1850_bus_time(0, WAIT_100us);
+				return J1850_RETURN_CODE_NO_DATA | 0x80;	// error, no responds within 100us
+			}
 		}
+		edge = TCNT1;
+		while( ((uint16_t)(TCNT1 - edge) < j1850_glitch_ticks) && is_j1850_listen_active() );
+		if( is_j1850_listen_active() ) break;
+		++stats.glitches;	// spike on the idle bus
 	}
+	j1850_bus_time(0, edge);	// idle time before the SOF, a loaded bus rarely reaches the timeout
+	edge = TCNT1 - edge;	// SOF time spent in the glitch filter
 	timer1_stop();
+#if J1850_CHANNELS > 1
+	if( j1850_listen_mask != j1850_in_mask )	// listening on both, go on with the active channel
+		j1850_select( is_j1850_active() ? j1850_channel : !j1850_channel );
+#endif
+	j1850_sof_time = time_base_now();	// frame start for response latency
 	// wait for SOF
 	timer1_start();	// restart timer1
-	while(is_j1850_active())	// run as long bus is active (SOF is an active symbol)
+	timer1_set(edge);
+	glitches = stats.glitches;
+	bit_state = is_j1850_active();	// active, SOF
+	do
 	{
-		if(TCNT1 >=  RX_SOF_MAX) {
-			return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error on SOF timeout
+		while(is_j1850_active())	// run as long bus is active (SOF is an active symbol)
+		{
+			if(TCNT1 >=  RX_SOF_MAX) {
+				++stats.sof_errors;
+				return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error on SOF timeout
+			}
 		}
-	}
+		edge = TCNT1;
+	} while( j1850_glitch(bit_state, edge) );
 	
 	timer1_stop();
-	if(TCNT1 < RX_SOF_MIN) return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error, symbole was not SOF
+	if(edge < RX_SOF_MIN)
+	{
+		++stats.sof_errors;
+		return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error, symbole was not SOF
+	}
+	sof = edge;
+	frame_ticks = sof;
 	
 	bit_state = is_j1850_active();	// store actual bus state
+	edge = TCNT1 - edge;	// next symbol started at the edge
 	timer1_start();
-	for(nbytes = 0; nbytes < checkLength ? 12 : RX_BUFFER_MAX_LEN; ++nbytes)
+	timer1_set(edge);
+	for(nbytes = 0; nbytes < (checkLength ? 12 : RX_BUFFER_MAX_LEN); ++nbytes)
 	{
 		nbits = 8;
 		do
 		{
 			*msg_buf <<= 1;
-			while(is_j1850_active() == bit_state) // compare last with actual bus state, wait for change
+			do
 			{
-				if(TCNT1 >= RX_EOD_MIN	)	// check for EOD symbol
+				while(is_j1850_active() == bit_state) // compare last with actual bus state, wait for change
 				{
-					timer1_stop();
-					return nbytes;	// return number of received bytes
+					if(TCNT1 >= long_max)	// check for EOD symbol, RX_EOD_MIN unless adapted
+					{
+						timer1_stop();
+						if( (nbytes >= 3) && !(*frame & J1850_HDR_ONE_BYTE) && (crc_reg == J1850_CRC_RESIDUE) &&
+							(short_cnt == RX_TIMING_SAMPLES) && (long_cnt == RX_TIMING_SAMPLES) )
+							rx_timing_add(*(frame+2), short_sum, long_sum, sof);
+						return j1850_recv_done(nbytes, crc_reg, frame_ticks, stats.glitches != glitches);	// return number of received bytes
+					}
 				}
-			}
+				edge = TCNT1;
+			} while( j1850_glitch(bit_state, edge) );	// spike, same symbol goes on
 			bit_state = is_j1850_active();	// store actual bus state
-			uint16_t tcnt1_buf = TCNT1;
-			timer1_start();
-			if( tcnt1_buf < RX_SHORT_MIN) return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error, pulse was to short
-
-			// check for short active pulse = "1" bit
-			if( (tcnt1_buf < RX_SHORT_MAX) && !is_j1850_active() )
-				*msg_buf |= 1;
+			uint16_t tcnt1_buf = edge;
+			timer1_set(TCNT1 - edge);	// next symbol started at the edge
+			frame_ticks += tcnt1_buf;
+			if( tcnt1_buf < RX_SHORT_MIN)
+			{
+				++stats.pulse_errors;
+				return J1850_RETURN_CODE_BUS_ERROR | 0x80;	// error, pulse was to short
+			}
 
-			// check for long passive pulse = "1" bit
-			if( (tcnt1_buf > RX_LONG_MIN) && (tcnt1_buf < RX_LONG_MAX) && is_j1850_active() )
-				*msg_buf |= 1;
+			if( tcnt1_buf < short_max )
+			{
+				// check for short active pulse = "1" bit
+				if( !bit_state ) *msg_buf |= 1;  // state after the edge, a spike since then does not count
+				if( short_cnt < RX_TIMING_SAMPLES ) { short_sum += tcnt1_buf; ++short_cnt; }
+			}
+			else if( tcnt1_buf > short_max )
+			{
+				// check for long passive pulse = "1" bit
+				if( (tcnt1_buf < long_max) && bit_state ) *msg_buf |= 1;
+				if( long_cnt < RX_TIMING_SAMPLES ) { long_sum += tcnt1_buf; ++long_cnt; }
+			}
 
 		} while(--nbits);// end 8 bit while loop
 		
+		crc_reg = j1850_crc_step(crc_reg, *msg_buf);  // next pulse is at least RX_SHORT_MIN away
+		if( (nbytes == 2) && j1850_rx_adapt && !(*frame & J1850_HDR_ONE_BYTE) )
+		{  // transmitter known, decide the data bytes on its measured timing
+			rx_timing_t *t = rx_timing_find(*msg_buf);
+			if( t && (t->frames >= RX_TIMING_FRAMES) )
+			{
+				short_max = t->short_max;
+				long_max = t->long_max;
+			}
+		}
 		++msg_buf;	// store next byte
 		
 	}	// end 12 byte for loop
 
-	// return after a maximum of 12 bytes
+	// return after a maximum of 12 bytes, or RX_BUFFER_MAX_LEN bytes without length check
 	timer1_stop();	
-	return nbytes;
+	return j1850_recv_done(nbytes, crc_reg, frame_ticks, stats.glitches != glitches);
 }
 
 
@@ -203,9 +514,10 @@ uint8_t j1850_send_msg(uint8_t *msg_buf, int8_t nbytes, bool checkLength)
 				delay = (temp_byte & 0x80) ? TX_LONG : TX_SHORT;	// send correct pulse lenght
 				while (TCNT1 <= delay)	// wait
 				{
-					if(!J1850_PORT_IN & _BV(J1850_PIN_IN))	// check for bus error
+					if( (TCNT1 > TX_SETTLE) && is_j1850_active() )	// check for bus error, bus active while we are passive, after our release edge
 					{
 						timer1_stop();
+						++stats.tx_errors;
 						return J1850_RETURN_CODE_BUS_ERROR;	// error, bus collision!
 					}
 				}
@@ -227,9 +539,37 @@ uint8_t j1850_send_msg(uint8_t *msg_buf, int8_t nbytes, bool checkLength)
 	timer1_start();
 	while (TCNT1 <= TX_EOF){} // wait for EOF complete
 	timer1_stop();
+	j1850_eof_time = time_base_now();
+	++stats.tx_frames;
 	return J1850_RETURN_CODE_OK;	// no error
 }
 
+/* 
+**--------------------------------------------------------------------------- 
+** 
+** Abstract: Send J1850 frame and receive the first frame after it.
+**           The receiver starts watching the bus right at the end of our
+**           EOF, before any serial output of the caller, so a responder
+**           starting its SOF at minimum IFS is received with full timing.
+** 
+** Parameters: Pointer to frame buffer, frame length, message length check,
+**             pointer to the result of j1850_recv_msg() for the first frame,
+**             the frame is received into the send buffer
+** 
+** Returns: return code of j1850_send_msg(), receive result only valid
+**          with J1850_RETURN_CODE_OK
+** 
+**--------------------------------------------------------------------------- 
+*/ 
+uint8_t j1850_send_recv(uint8_t *msg_buf, int8_t nbytes, bool checkLength, uint8_t *recv_nbytes)
+{
+	uint8_t return_code = j1850_send_msg(msg_buf, nbytes, checkLength);
+
+	if(return_code == J1850_RETURN_CODE_OK)
+		*recv_nbytes = j1850_recv_msg(msg_buf, checkLength);	// bus is passive since EOF began
+	return return_code;
+}
+
 /* 
 **--------------------------------------------------------------------------- 
 ** 
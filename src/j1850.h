@@ -19,10 +19,27 @@
 **  08/05/05     v1.04 Michael  * changed to use Timer1
 **  10/07/21     v1.09 Remi S   * changed j1850 send and receive functions definitions to support message length check parameter
 **                              * define RX_BUFFER_MAX_LEN to 64 (bytes) as a maximum receive buffer length if NOT checking for message length (should be SERIAL_MSG_BUF_SIZE/2)
+**  19/10/26     v1.10 Remi S   + added Timer1 prescaler for raw pulse capture
+**                              + added bus and interface statistics counters
+**                              + added Timer0 time base and SOF timestamp
+**                              + added j1850_send_recv() for a receive without gap after our EOF
+**                              * integer us2cnt with Timer1 prescaler selected from MCU_XTAL
+**                              + added optional second J1850 channel, pins selected per channel
+**                              + added coarse time base for ages of minutes
+**                              + added measured symbol timing per transmitter, optional adaptive thresholds
+**                              * RX_BUFFER_MAX_LEN is the size of every frame buffer, 12 bytes by default
+**                              * Timer0 registers through mcu.h for other MCUs
+**                              + added glitch filter for the receiver with glitch counters
+**                              * RX_TIMING_TARGETS scaled by MCU_SRAM_SCALE
+**                              * pulse capture prescaler chosen from MCU_XTAL
+**                              + added J1850_HDR_ONE_BYTE header type bit
+**                              + added TX_SETTLE transceiver release delay
 **
 **************************************************************************/
 
 #include <stdbool.h>
+#include <avr/interrupt.h>
+#include "mcu.h"
 
 #ifndef __J1850_H__
 #define __J1850_H__
@@ -41,26 +58,72 @@
 #define	J1850_PIN_OUT_NEG			// define output level inverted by hardware
 #define	J1850_PIN_IN_NEG			// define input level inverted by hardware
 
+#ifndef J1850_CHANNELS
+#define J1850_CHANNELS	1			// 2 = second J1850 channel, same ports and levels as the first
+#endif
+#define J1850_PIN_OUT_B	4			// second channel output pin
+#define J1850_PIN_IN_B	1			// second channel input pin
+
 /*** CONFIG END ***/
 
+#if J1850_CHANNELS > 1
+uint8_t j1850_channel;  // selected channel, 0 = first, 1 = second
+uint8_t j1850_in_mask;  // input pin of the selected channel
+uint8_t j1850_out_mask;  // output pin of the selected channel
+uint8_t j1850_listen_mask;  // input pins j1850_recv_msg() waits on for a frame start
+#else
+#define j1850_channel	0
+#define j1850_in_mask	_BV(J1850_PIN_IN)
+#define j1850_out_mask	_BV(J1850_PIN_OUT)
+#define j1850_listen_mask	_BV(J1850_PIN_IN)
+#endif
+
 #ifdef J1850_PIN_OUT_NEG
-	#define j1850_active() J1850_PORT_OUT &=~ _BV(J1850_PIN_OUT)
-	#define j1850_passive() J1850_PORT_OUT |= _BV(J1850_PIN_OUT)
+	#define j1850_active() J1850_PORT_OUT &=~ j1850_out_mask
+	#define j1850_passive() J1850_PORT_OUT |= j1850_out_mask
 #else
-	#define j1850_active() J1850_PORT_OUT |= _BV(J1850_PIN_OUT)
-	#define j1850_passive() J1850_PORT_OUT &=~ _BV(J1850_PIN_OUT)
+	#define j1850_active() J1850_PORT_OUT |= j1850_out_mask
+	#define j1850_passive() J1850_PORT_OUT &=~ j1850_out_mask
 #endif
 
 #ifdef J1850_PIN_IN_NEG
-#define is_j1850_active() bit_is_clear(J1850_PORT_IN, J1850_PIN_IN)
+#define is_j1850_active() (!(J1850_PORT_IN & j1850_in_mask))
+#define is_j1850_listen_active() ((J1850_PORT_IN & j1850_listen_mask) != j1850_listen_mask)
 #else
-#define is_j1850_active() bit_is_set(J1850_PORT_IN, J1850_PIN_IN)
+#define is_j1850_active() (J1850_PORT_IN & j1850_in_mask)
+#define is_j1850_listen_active() (J1850_PORT_IN & j1850_listen_mask)
 #endif
 
-/* Define Timer1 Prescaler here */
-#define c_start_pulse_timer	0x01  // Timer1 runs without Prescaler, 135ns tick @ 7,3728MHz
+/* Timer1 Prescaler, smallest one that lets the longest timed interval fit in 16 bit */
+#define TIMER1_LONGEST_US	1000UL  // WAIT_100us, longest time measured by Timer1 from zero
+
+#if (MCU_XTAL / 100UL) * TIMER1_LONGEST_US / 10000UL <= 0xFFFF
+	#define J1850_PRESCALER	1
+	#define c_start_pulse_timer	0x01  // Timer1 runs without Prescaler, 135ns tick @ 7,3728MHz
+#elif (MCU_XTAL / 100UL) * TIMER1_LONGEST_US / 80000UL <= 0xFFFF
+	#define J1850_PRESCALER	8
+	#define c_start_pulse_timer	0x02  // Timer1 clk/8
+#else
+	#define J1850_PRESCALER	64
+	#define c_start_pulse_timer	0x03  // Timer1 clk/64
+#endif
 #define c_stop_pulse_timer	0x00
 
+// Timer1 free running for raw pulse capture, the tick is at least 0.95us so the
+// longest symbol (239us) fits one byte: clk/8 up to 8.4MHz (1.085us @ 7,3728MHz),
+// clk/64 above (4us @ 16MHz)
+#if MCU_XTAL <= 8400000UL
+	#define PULSE_PRESCALER	8
+	#define c_capture_pulse_timer	0x02  // Timer1 clk/8
+#else
+	#define PULSE_PRESCALER	64
+	#define c_capture_pulse_timer	0x03  // Timer1 clk/64
+#endif
+#define PULSE_TICK_NS	(PULSE_PRESCALER * 1000000UL / (MCU_XTAL / 1000UL))  // pulse capture tick
+
+/* Timer0 time base, 8 bit timer extended to 16 bit by its overflow interrupt */
+#define c_start_time_base	_BV(CS02)  // Timer0 clk/256, 34.72us tick @ 7,3728MHz, wraps after 2.27s
+
 
 // define error return codes
 #define J1850_RETURN_CODE_UNKNOWN    0
@@ -71,8 +134,13 @@
 #define J1850_RETURN_CODE_NO_DATA    5
 #define J1850_RETURN_CODE_DATA       6
 
-// convert microseconds to counter values
-#define us2cnt(us) ((unsigned int)((unsigned long)(us) / (1000000L / (float)((unsigned long)MCU_XTAL / 1L))))
+// convert microseconds to counter values, integer only so it also works in #if,
+// truncated like the former float formula (same values with the 7.3728MHz crystal)
+#define us2cnt_raw(us) ((unsigned long)(us) * (MCU_XTAL / 100UL) / (10000UL * J1850_PRESCALER))
+#define us2cnt(us) ((unsigned int)us2cnt_raw(us))
+
+// fewest Timer1 ticks that still resolve a pulse, the receive loop polls the input pin
+#define J1850_TICKS_MIN	8
 
 #define WAIT_100us	us2cnt(1000)		// 100us, used to count 100ms
 
@@ -91,6 +159,10 @@
 #define TX_IFR_SHORT_CRC	us2cnt(64)	// short In Frame Respond, IFR contain CRC
 #define TX_IFR_LONG_NOCRC us2cnt(128)	// long In Frame Respond, IFR contain no CRC
 
+// transceiver delay, after we release the bus the slew limited edge takes some us and
+// the input still reads our own active level, a collision is only checked after it
+#define TX_SETTLE	us2cnt(20)	// release edge settle time, below RX_SHORT_MIN
+
 // receiving pulse width
 #define RX_SHORT_MIN	us2cnt(34)	// minimum short pulse time
 #define RX_SHORT_MAX	us2cnt(96)	// maximum short pulse time
@@ -110,15 +182,85 @@
 #define RX_IFR_LONG_MIN		us2cnt(96)		// minimum long in frame respond pulse time
 #define RX_IFR_LONG_MAX		us2cnt(163)		// maximum long in frame respond pulse time
 
-// Maximum message length if not checking for length
-#define RX_BUFFER_MAX_LEN   64
+// measured receive timing per transmitter, thresholds centred on it with j1850_rx_adapt
+#define RX_TIMING_TARGETS	(2 * MCU_SRAM_SCALE)  // number of transmitter addresses
+#define RX_TIMING_SAMPLES	8  // short and long pulses measured per frame, must be a power of 2
+#define RX_TIMING_FRAMES	4  // frames measured before the thresholds are moved
+#define J1850_HDR_ONE_BYTE	0x10  // H bit of the first header byte, set for a one byte header without source address
+
+typedef struct
+{
+	uint8_t addr;  // transmitter address, header byte 3
+	uint8_t frames;  // frames measured, saturates at 255, 0 = entry free
+	uint16_t short_avg;  // running averages in Timer1 ticks
+	uint16_t long_avg;
+	uint16_t sof_avg;
+	uint16_t short_max;  // short/long decision, midway between short and long average
+	uint16_t long_max;  // long/EOD decision, midway between long and SOF average
+} rx_timing_t;
+
+rx_timing_t rx_timing[RX_TIMING_TARGETS];
+bool j1850_rx_adapt;  // use measured thresholds for the data bytes after the header
+
+// Receive glitch filter, an edge counts once the bus stays in its new state this
+// long, shorter spikes are merged into the running symbol. The input is not on
+// ICP1, so the Timer1 input capture noise canceler can not be used.
+#ifndef J1850_GLITCH_US
+#define J1850_GLITCH_US		0	// default filter width in us, 0 = off
+#endif
+#define J1850_GLITCH_US_MAX	16	// well below RX_SHORT_MIN
+
+uint16_t j1850_glitch_ticks;  // filter width in Timer1 ticks
+
+// Maximum message length if not checking for length, every frame buffer holds this
+// many bytes, raise it (makefile) for frames beyond the SAE 12 bytes if SRAM allows
+#ifndef RX_BUFFER_MAX_LEN
+#define RX_BUFFER_MAX_LEN   12
+#endif
+
+// CRC register remainder after a frame including its correct CRC byte
+#define J1850_CRC_RESIDUE	0xC4
+
+// bus and interface statistics, updated by the J1850 and USART drivers
+typedef struct
+{
+	uint16_t rx_frames;  // frames received
+	uint16_t tx_frames;  // frames sent
+	uint16_t crc_errors;  // frames received with wrong CRC
+	uint16_t sof_errors;  // start of frame too short or too long
+	uint16_t pulse_errors;  // data pulse shorter than minimum
+	uint16_t tx_errors;  // bus collision while sending, arbitration lost
+	uint16_t uart_overruns;  // chars lost by the USART or a full Rx ring buffer
+	uint16_t output_drops;  // output lost on a full Tx ring buffer
+	uint16_t glitches;  // spikes shorter than the glitch filter ignored by the receiver
+	uint16_t glitch_saves;  // frames received with a correct CRC after glitches were ignored
+	uint32_t bus_active;  // Timer1 ticks inside received frames
+	uint32_t bus_idle;  // Timer1 ticks of idle bus while receiving, both halved together before overflow
+} stats_t;
+
+stats_t stats;
 
 uint8_t timeout_multiplier;  // default 4ms timeout multiplier
 
+volatile uint8_t time_base_high;  // Timer0 overflow count, time stamp high byte
+volatile uint8_t time_base_upper;  // time_base_high overflow count, see time_base_coarse()
+uint16_t j1850_sof_time;  // time stamp of the last frame start seen by j1850_recv_msg()
+uint16_t j1850_eof_time;  // time stamp at the end of the last frame sent
+
 extern void j1850_init(void);
 extern uint8_t j1850_recv_msg(uint8_t *msg_buf, bool checkLength);
 extern uint8_t j1850_send_msg(uint8_t *msg_buf, int8_t nbytes, bool checkLength);
+extern uint8_t j1850_send_recv(uint8_t *msg_buf, int8_t nbytes, bool checkLength, uint8_t *recv_nbytes);
 extern uint8_t j1850_crc(uint8_t *msg_buf, int8_t nbytes);
+#if J1850_CHANNELS > 1
+extern void j1850_select(uint8_t channel);
+
+// next receive takes a frame from whichever channel starts one first
+static inline void j1850_listen_all(void)
+{
+	j1850_listen_mask = _BV(J1850_PIN_IN) | _BV(J1850_PIN_IN_B);
+}
+#endif
 
 static inline void timer1_ctrl(uint8_t val)
 {
@@ -141,4 +283,26 @@ static inline void timer1_set(uint16_t val)
     TCNT1 = val;
 }
 
+// 16 bit time stamp in Timer0 ticks
+static inline uint16_t time_base_now(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t high = time_base_high;
+	uint8_t low = TCNT0;
+	if( (TIMER0_TIFR & _BV(TOV0)) && !(low & 0x80) ) ++high;  // overflow not serviced yet
+	SREG = sreg;
+	return ((uint16_t)high << 8) | low;
+}
+
+// 16 bit time stamp in Timer0 overflows, 8.9ms @ 7,3728MHz, wraps after 9.7 minutes
+static inline uint16_t time_base_coarse(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t = ((uint16_t)time_base_upper << 8) | time_base_high;
+	SREG = sreg;
+	return t;
+}
+
 #endif // __J1850_H__
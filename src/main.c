@@ -35,6 +35,38 @@
 **								+ AVR-GCC 7.3.0 supported
 **  10/07/21    v1.09   Remi S  + added parameter for message length checking or not
 **                              * changed j1850 receive and send functions calls to integrate message length check parameter
+**  19/10/26    v1.10   Remi S  * USART Rx interrupt only fills a ring buffer, commands are processed in main loop
+**                              + added command AT Kx for RTS/CTS or XON/XOFF flow control
+**                              - fixed silent command corruption on serial buffer overflow
+**                              + added 230.4k/460.8k baud rates and AT BNx negotiated baud rate switch
+**                              * USART output is interrupt driven through a transmit ring buffer
+**                              + added command AT MCx for continuous monitoring, own frames are tagged inline
+**                              - fixed packed monitor length byte error indicator and CRC check without headers
+**                              + response pending ($7F xx $78) restarts the response timeout
+**                              + added command AT Nx to match responses by service id, negative responses are tagged
+**                              + added command AT Qx for pipelined requests to several receive addresses
+**                              + added command AT Ux for ECU emulation, requests are answered from a responder table
+**                              + added command AT Tx for trigger capture with pre-trigger history
+**                              + added command AT MP for raw pulse width capture
+**                              + added commands AT IS, AT IB and AT IR for bus and interface statistics
+**                              + added command AT IL for response latency histograms per receive address
+**                              + added command AT IM for free SRAM, stack high water mark and frame buffer overruns
+**                              + added commands AT WS, AT WL and AT WC to keep the configuration in EEPROM, loaded at boot
+**                              * receiver is armed at the end of our request, no gap before the first response
+**                              * baud rates checked against MCU_XTAL, AT Bx refuses rates the crystal cannot make
+**                              + added commands AT GA, AT GC, AT G0/G1 and AT GS for the gateway between two J1850 channels
+**                              + added commands AT VA, AT VC, AT VG, AT VL and AT VD for the latest value cache
+**                              + added commands AT J0, AT J1 and AT JS for receive thresholds adapted to each transmitter
+**                              * frames live in one pool of slots handed over by number, AT SD bounded by the slot size
+**                              + added commands AT XA, AT XC, AT X0/X1 and AT XL for signal extraction
+**                              + builds for ATmega32 and ATmega328P, registers and vectors from mcu.h
+**                              + added command AT JG for the receive glitch filter, glitch counters in AT IS
+**                              + added commands AT S0/S1 for spaces and AT P0/P1 for the prompt, frames rendered
+**                                into the Tx ring buffer in one pass
+**                              + added commands AT CT and AT CC for a response cache of repeated requests
+**                              + compile time check of the SRAM budget
+**                              * AT VG/VL/VD ages saturate instead of wrapping after 9.7 minutes
+**                              * AT MP tick follows MCU_XTAL
 **								
 **
 **  Used develompent tools (download @ www.avrfreaks.net):
@@ -58,167 +90,1943 @@
 **************************************************************************/
 #include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <avr/eeprom.h>
 #include <ctype.h>
-#include "main.h"
 #include "j1850.h"
+#include "main.h"
+
+_Static_assert(SRAM_TABLES + SRAM_SCALARS <= MCU_SRAM_SIZE - MCU_STACK_RESERVE,
+			   "buffers and tables do not leave MCU_STACK_RESERVE bytes of SRAM for the stack");
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Main routine
+**
+**
+** Parameters: none
+**
+**
+** Returns: NULL
+**
+**
+**---------------------------------------------------------------------------
+*/
+// main routine
+int16_t main( void )
+{
+	mcu_init();	// make sure the watchdog is not running
+	UBRRH = DEFAULT_BAUD>>8;		// set baud rate
+	UBRRL = DEFAULT_BAUD;
+	UCSRB =((1<<RXCIE)|(1<<RXEN)|(1<<TXEN));	// enable Rx & Tx, enable Rx interrupt
+	UCSRC = USART_8N1;	// config USART; 8N1
+	serial_msg_pntr = &serial_msg_buf[0];  // init serial msg pointer
+
+	FLOW_PORT_OUT &=~ _BV(FLOW_PIN_RTS);	// RTS asserted, host may send
+	FLOW_DIR_OUT |= _BV(FLOW_PIN_RTS);	// make RTS pin an output
+	FLOW_PULLUP_IN |= _BV(FLOW_PIN_CTS);	// enable pull-up on CTS pin
+	FLOW_DIR_IN &=~ _BV(FLOW_PIN_CTS);	// make CTS pin an input
+	
+	j1850_init();	// init J1850 bus
+	frame_pool_init();	// all frame buffers free
+
+	config_load(true);	// saved configuration and baud rate, compiled defaults otherwise
+
+	sei();	// enable global interrupts, serial output is interrupt driven
+
+	ident();	// send identification to terminal
+
+	if(CHECKBIT(format_bits, PROMPT)) serial_putc('>');  // send initial command prompt
+
+	for(;;)
+	{
+		resp_cache_expire();  // drop stale responses before the coarse time base wraps
+		cache_age_limit();
+		serial_poll();  // process received chars and commands
+
+		while( is_monitoring() )
+		{
+			resp_cache_expire();  // monitoring may last longer than a wrap of the coarse time base
+			cache_age_limit();
+			if( serial_tx_head != serial_tx_tail ) UCSRB |= _BV(UDRIE);  // host may have raised CTS again
+
+			if( serial_rx_head != serial_rx_tail )
+			{
+				if( CHECKBIT(parameter_bits, MON_CONT) )
+				{
+					serial_poll();  // execute commands while monitoring continues
+					continue;
+				}
+
+				// end monitor modes on any received char
+				serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_RING_SIZE - 1);  // discard char
+				CLEARBIT(parameter_bits,MON_RX);
+				CLEARBIT(parameter_bits,MON_TX);
+				CLEARBIT(parameter_bits,MON_OBH);
+				serial_puts_P(stopped);
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal
+				break;
+			}
+
+			bus_poll();  // get J1850 frame
+		} // end while monitoring active
+
+		if( pipe_pending || ecu_entries || cache_entries || signal_entries || is_capturing() ) bus_poll();  // background bus receive
+#if J1850_CHANNELS > 1
+		else if( gateway_on ) bus_poll();
+#endif
+	}	// endless loop
+	
+	return 0;
+} // end of main()
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Receive one J1850 frame in background, route it to a pipelined
+**           request or the monitor output, and age pipelined requests
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void bus_poll(void)
+{
+	uint8_t slot = frame_alloc();  // J1850 message buffer
+	uint8_t *j1850_msg_buf = frame_data(slot);
+	int8_t recv_nbytes;  // byte counter		
+
+	if( slot == FRAME_NONE ) return;  // pool is sized for the deepest nesting, never happens
+#if J1850_CHANNELS > 1
+	if( gateway_on ) j1850_listen_all();  // frame from either channel
+#endif
+	recv_nbytes = j1850_recv_msg(j1850_msg_buf, CHECKBIT(parameter_bits, MSG_LEN));	// get J1850 frame
+	frame_guard_check(slot);
+
+	if( !(recv_nbytes & 0x80) ) // proceed only with no errors
+	{
+		slot = capture_take(slot, recv_nbytes);  // frame stays valid while dispatched
+		frame_dispatch(j1850_msg_buf, recv_nbytes);
+	}
+	frame_release(slot);
+#if J1850_CHANNELS > 1
+	j1850_select(host_channel);
+#endif
+
+	pipeline_tick();
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Route a received frame which is not the response of a blocking
+**           request, pipelined responses first, then the ECU emulation
+**           and monitor output
+**
+** Parameters: Pointer to frame buffer, frame length including CRC
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void frame_dispatch(uint8_t *msg_buf, int8_t nbytes)
+{
+	uint8_t ecu_slot = FRAME_NONE;  // emulated ECU response
+	int8_t ecu_nbytes = 0;
+
+#if J1850_CHANNELS > 1
+	if( gateway_on ) gateway_forward(msg_buf, nbytes);  // forward first, other bus waits least
+#endif
+
+	if( cache_entries ) cache_update(msg_buf, nbytes);
+	if( signal_entries ) signal_update(msg_buf, nbytes);
+
+	if( pipe_pending && pipeline_match(msg_buf, nbytes) ) return;
+
+	if( ecu_entries && ((ecu_slot = frame_alloc()) != FRAME_NONE) )
+		ecu_nbytes = ecu_respond(msg_buf, nbytes, frame_data(ecu_slot));  // answer first, output later
+
+	if( is_monitoring() )
+	{
+		if( monitor_filter(msg_buf) ) monitor_output(msg_buf, nbytes, MON_TAG_NONE);
+		if( ecu_nbytes && CHECKBIT(parameter_bits, MON_CONT) )
+			monitor_output(frame_data(ecu_slot), ecu_nbytes, MON_TAG_TX);  // show own response inline
+	}
+	frame_release(ecu_slot);
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Check a received frame against the monitor mode addresses
+**
+** Parameters: Pointer to frame buffer
+**
+** Returns: true when the frame has to be shown
+**
+**---------------------------------------------------------------------------
+*/
+bool monitor_filter(uint8_t *msg_buf)
+{
+	// check for respond from correct addr or monitor all mode
+	return (CHECKBIT(parameter_bits, MON_RX) && CHECKBIT(parameter_bits, MON_TX))
+		   ||
+		   ((mon_receiver == *(msg_buf+1)) && CHECKBIT(parameter_bits, MON_RX) )
+		   ||
+		   ((mon_transmitter == *(msg_buf+2)) && CHECKBIT(parameter_bits, MON_TX) )
+		   ||
+		   ((mon_transmitter == *(msg_buf)) && CHECKBIT(parameter_bits, MON_OBH) );
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output a J1850 frame in monitor format
+**
+** Parameters: Pointer to frame buffer, frame length including CRC,
+**             MON_TAG_NONE for bus traffic, or a tag marking our own
+**             traffic in continuous monitor mode or the trigger frame
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void monitor_output(uint8_t *msg_buf, int8_t nbytes, uint8_t tag)
+{
+	uint8_t *msg_pntr = msg_buf;
+
+	if(nbytes <= 0) return;  // nothing received after SOF
+
+	// check respond CRC before any header byte is skipped
+	bool crc_ok = ( *(msg_pntr+(nbytes-1)) == j1850_crc(msg_buf, nbytes-1) );
+
+	// surpess CRC and header bytes output
+	if( !CHECKBIT(parameter_bits, HEADER) )
+	{ 
+		if( CHECKBIT(parameter_bits, MON_OBH) ||  // check if one byte header frames are used
+			CHECKBIT(parameter_bits, USE_OBH)
+		   )
+		{
+		  nbytes -= 2;  // discard 1st header byte and CRC
+		  msg_pntr += 1;  // skip header byte
+		}
+		else
+		{
+		  nbytes -= 4;  // discard 3 header bytes and CRC
+		  msg_pntr += 3;  // skip 3 header bytes
+		}
+	}
+
+	if(tag == MON_TAG_PIPE) tag = MON_TAG_NONE;  // prefix already sent by pipeline_output()
+
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		if(tag != MON_TAG_NONE) serial_putc(tag);  // tag byte ahead of length byte
+		if( crc_ok )
+			serial_putc(nbytes);  // length byte
+		else
+			serial_putc(nbytes|0x80);  // length byte with error indicator set
+	}
+	else if(tag != MON_TAG_NONE)
+	{
+		serial_putc(pgm_read_byte(&mon_tag_txt[tag & 0x0F]));
+		serial_putc(' ');
+	}
+
+	// output response data
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		for(;nbytes > 0; nbytes--)
+			serial_putc(*msg_pntr++);  // data byte
+	}
+	else
+		serial_put_frame2ascii(msg_pntr, nbytes);  // formated output with CR and optional LF
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Raw pulse width capture (logic analyzer mode).
+**           Timer1 runs free at clk/8 or clk/64 (see PULSE_PRESCALER) and
+**           every bus level change is timestamped, so no time is lost
+**           restarting the timer. Pulses alternate active/passive starting
+**           with an active pulse, each one is sent as one byte
+**           (PULSE_TICK_NS, 1.085us @ 7,3728MHz) or PULSE_LONG and 16 bit
+**           width. Output never waits, pulses not fitting into the Tx ring
+**           buffer are reported as PULSE_LOST and a count. Runs until any
+**           char is received, then sends PULSE_END.
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void pulse_capture(void)
+{
+	uint16_t last, now, width;
+	uint8_t ovf = 0;  // Timer1 overflows since last edge, max 2
+	uint8_t lost = 0;  // pulses not sent yet
+	bool bit_state;
+
+	// start with a complete active pulse, wait for bus passive then active
+	while( is_j1850_active() && (serial_rx_head == serial_rx_tail) );
+	while( !is_j1850_active() && (serial_rx_head == serial_rx_tail) );
+
+	TCCR1B = c_capture_pulse_timer;
+	TIMER1_TIFR = _BV(TOV1);  // clear overflow flag
+	bit_state = true;
+	last = TCNT1;
+
+	while( serial_rx_head == serial_rx_tail )
+	{
+		if( is_j1850_active() == bit_state )
+		{
+			if( TIMER1_TIFR & _BV(TOV1) )
+			{
+				TIMER1_TIFR = _BV(TOV1);
+				if( ovf < 2 ) ++ovf;
+			}
+			continue;
+		}
+
+		now = TCNT1;  // level change
+		bit_state = !bit_state;
+		width = now - last;
+		if( (ovf > 1) || (ovf && (now >= last)) ) width = 0xFFFF;  // saturate long idle
+		last = now;
+		ovf = 0;
+		TIMER1_TIFR = _BV(TOV1);
+
+		if( lost )
+		{
+			++stats.output_drops;
+			if( lost < 0xFF ) ++lost;  // keep counting until the report fits
+			if( ((serial_tx_tail - serial_tx_head - 1) & (SERIAL_TX_RING_SIZE - 1)) < 2 ) continue;
+			serial_try_putc(PULSE_LOST);
+			serial_try_putc(lost);
+			lost = 0;
+			continue;
+		}
+
+		if( width <= PULSE_SHORT_MAX )
+		{
+			if( !serial_try_putc(width) )
+			{
+				++stats.output_drops;
+				lost = 1;
+			}
+		}
+		else if( ((serial_tx_tail - serial_tx_head - 1) & (SERIAL_TX_RING_SIZE - 1)) >= 3 )
+		{
+			serial_try_putc(PULSE_LONG);
+			serial_try_putc(width >> 8);
+			serial_try_putc(width);
+		}
+		else
+		{
+			++stats.output_drops;
+			lost = 1;
+		}
+	}
+
+	timer1_stop();
+	serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_RING_SIZE - 1);  // discard stop char
+	serial_putc(PULSE_END);
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output the statistics counters and the bus load, see AT IS
+**           and AT IB. Binary output is a length byte followed by the
+**           counters in stats_t order, high byte first.
+**
+** Parameters: true = binary, false = one text line per counter
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void stats_output(bool binary)
+{
+	stats_t snap;  // consistent copy, the USART interrupt updates counters
+	uint16_t *counter = &snap.rx_frames;
+	uint32_t total;
+	uint8_t load, i;
+
+	cli();
+	snap = stats;
+	sei();
+
+	if(binary)
+	{
+		serial_putc(sizeof(snap));  // length byte
+		for(i = 0; i < STATS_COUNTERS; ++i, ++counter)
+		{
+			serial_putc(*counter >> 8);
+			serial_putc(*counter);
+		}
+		for(i = 24; i < 32; i -= 8) serial_putc(snap.bus_active >> i);
+		for(i = 24; i < 32; i -= 8) serial_putc(snap.bus_idle >> i);
+		return;
+	}
+
+	for(i = 0; i < STATS_COUNTERS; ++i, ++counter)
+	{
+		serial_puts_P(stats_txt[i]);
+		serial_put_byte2ascii(*counter >> 8);
+		serial_put_byte2ascii(*counter);
+		serial_putc('\r');
+		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	}
+
+	// bus load in percent of the observed time, counters stay below 2^31
+	total = (snap.bus_active + snap.bus_idle) / 100;
+	load = total ? snap.bus_active / total : 0;
+	serial_puts_P(PSTR("BUS LOAD "));
+	if(load >= 100)
+		serial_puts_P(PSTR("100"));
+	else
+	{
+		serial_putc('0' + load / 10);
+		serial_putc('0' + load % 10);
+	}
+	serial_putc('%');
+	serial_putc('\r');
+	if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Add one request to response latency to the histogram of the
+**           receive address, a new address takes a free histogram
+**
+** Parameters: receive address, latency in Timer0 ticks
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void latency_add(uint8_t addr, uint16_t ticks)
+{
+	latency_hist_t *h = latency_hist;
+	uint8_t bucket = 0;
+
+	for(; h < &latency_hist[LATENCY_TARGETS]; ++h)
+		if( !h->used || (h->addr == addr) ) break;
+	if( h == &latency_hist[LATENCY_TARGETS] ) return;  // all histograms in use
+
+	h->used = true;
+	h->addr = addr;
+
+	// bucket 0 below 16 ticks, then one bucket per power of 2
+	for(uint16_t t = ticks >> 4; t && (bucket < LATENCY_BUCKETS-1); t >>= 1) ++bucket;
+
+	if( h->count[bucket] != 0xFFFF ) ++h->count[bucket];
+	if( ticks > h->max ) h->max = ticks;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output the latency histograms, one line per receive address:
+**           address, bucket counts and longest latency, all hex
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void latency_output(void)
+{
+	for(latency_hist_t *h = latency_hist; h < &latency_hist[LATENCY_TARGETS]; ++h)
+	{
+		if( !h->used ) continue;
+
+		serial_put_byte2ascii(h->addr);
+		serial_putc(':');
+		for(uint8_t i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			serial_putc(' ');
+			serial_put_byte2ascii(h->count[i] >> 8);
+			serial_put_byte2ascii(h->count[i]);
+		}
+		serial_puts_P(PSTR(" MAX "));
+		serial_put_byte2ascii(h->max >> 8);
+		serial_put_byte2ascii(h->max);
+		serial_putc('\r');
+		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output the measured receive timing, one line per transmitter:
+**           address, frames measured (saturating at FF), short, long and
+**           SOF averages in Timer1 ticks, all hex, then the skew of the
+**           data pulses against nominal timing in percent, + = slower
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void rx_timing_output(void)
+{
+	for(rx_timing_t *t = rx_timing; t < &rx_timing[RX_TIMING_TARGETS]; ++t)
+	{
+		if( !t->frames ) continue;
+
+		int16_t skew = (int32_t)(t->short_avg + t->long_avg) * 1000 / (int16_t)(TX_SHORT + TX_LONG) - 1000;  // per mille
+
+		serial_put_byte2ascii(t->addr);
+		serial_puts_P(PSTR(": "));
+		serial_put_byte2ascii(t->frames);
+		serial_putc(' ');
+		serial_put_byte2ascii(t->short_avg >> 8);
+		serial_put_byte2ascii(t->short_avg);
+		serial_putc(' ');
+		serial_put_byte2ascii(t->long_avg >> 8);
+		serial_put_byte2ascii(t->long_avg);
+		serial_putc(' ');
+		serial_put_byte2ascii(t->sof_avg >> 8);
+		serial_put_byte2ascii(t->sof_avg);
+		serial_puts_P(PSTR(" SKEW "));
+		serial_putc(skew < 0 ? '-' : '+');
+		if( skew < 0 ) skew = -skew;
+		if( skew > 999 ) skew = 999;
+		serial_putc('0' + skew / 100);
+		serial_putc('0' + (skew / 10) % 10);
+		serial_putc('.');
+		serial_putc('0' + skew % 10);
+		serial_putc('%');
+		serial_putc('\r');
+		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Paint the free SRAM between the end of data and the top of the
+**           stack with STACK_CANARY. Runs from .init1 before the stack
+**           pointer is set up, so it uses registers only.
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void stack_paint(void)
+{
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_CANARY)
+	);
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Find the deepest stack use since reset, the stack grows down
+**           into the painted SRAM above the end of data
+**
+** Parameters: none
+**
+** Returns: number of bytes never used by the stack
+**
+**---------------------------------------------------------------------------
+*/
+uint16_t stack_free_min(void)
+{
+	uint8_t *p = &_end;
+
+	while( (p <= &__stack) && (*p == STACK_CANARY) ) ++p;
+	return p - &_end;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Free all slots of the frame buffer pool, set their guard
+**           bytes and give the request path its slot
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+_Static_assert(FRAME_SLOT_LEN >= 12, "a frame slot must hold a 12 byte J1850 frame");
+_Static_assert(FRAME_SLOTS < FRAME_NONE, "too many frame slots");
+
+void frame_pool_init(void)
+{
+	for(uint8_t i = 0; i < FRAME_SLOTS; ++i)
+	{
+		frame_pool[i].len = FRAME_FREE;
+		memset(frame_pool[i].guard, FRAME_GUARD, FRAME_GUARD_LEN);
+	}
+	memset(capture_slot, FRAME_NONE, sizeof(capture_slot));
+	frame_request = frame_alloc();
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Take a free slot from the frame buffer pool
+**
+** Parameters: none
+**
+** Returns: slot number, FRAME_NONE when all slots are in use
+**
+**---------------------------------------------------------------------------
+*/
+uint8_t frame_alloc(void)
+{
+	for(uint8_t i = 0; i < FRAME_SLOTS; ++i)
+	{
+		if( frame_pool[i].len == FRAME_FREE )
+		{
+			frame_pool[i].len = 0;
+			return i;
+		}
+	}
+	return FRAME_NONE;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Give a slot back to the frame buffer pool
+**
+** Parameters: slot number, FRAME_NONE is ignored
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void frame_release(uint8_t slot)
+{
+	if( slot < FRAME_SLOTS ) frame_pool[slot].len = FRAME_FREE;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Count a frame buffer overrun and restore the guard bytes
+**
+** Parameters: slot number
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void frame_guard_check(uint8_t slot)
+{
+	frame_buf_t *frame = &frame_pool[slot];
+
+	for(uint8_t i = 0; i < FRAME_GUARD_LEN; ++i)
+	{
+		if( frame->guard[i] != FRAME_GUARD )
+		{
+			++frame_guard_hits;
+			memset(frame->guard, FRAME_GUARD, FRAME_GUARD_LEN);
+			return;
+		}
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Send program ident string to terminal
+**
+**
+** Parameters: none
+**
+**
+** Returns: none
+**
+**
+**---------------------------------------------------------------------------
+*/
+void ident(void)
+{
+	serial_puts_P(ident_txt);  // show code description
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Convert 2 byte ASCII hex to 1 byte decimal
+**
+**
+** Parameters: Pointer to first ASCII char
+**
+**
+** Returns: decimal value
+**
+**
+**---------------------------------------------------------------------------
+*/
+static uint8_t ascii2byte(char *val)
+{
+	uint8_t temp = *val;
+	
+	if(temp > 0x60) temp -= 39;  // convert chars a-f
+	temp -= 48;  // convert chars 0-9
+	temp *= 16;
+	
+	temp += *(val+1);
+	if(*(val+1) > 0x60) temp -= 39;  // convert chars a-f
+	temp -= 48;  // convert chars 0-9	
+
+	return temp;
+
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Set USART baud rate
+**
+** Parameters: ASCII digit of baud rate, see AT Bx
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+_Static_assert(BAUD_VALID(BAUD_RATE, 16), "BAUD_RATE error too large with MCU_XTAL");
+
+static void serial_set_baud(char rate)
+{
+	serial_baud = rate;
+	UCSRA &=~ _BV(U2X);  // normal speed for all rates below 230.4k
+
+	switch(rate)
+	{
+#if BAUD_VALID(9600, 16)
+		case '0':
+		  UBRRH = BAUD_9600>>8;		// set 9600 Baud
+		  UBRRL = BAUD_9600;
+		  break;
+#endif
+
+#if BAUD_VALID(14400, 16)
+		case '1':
+		  UBRRH = BAUD_14400>>8;		// set 14.4k Baud
+		  UBRRL = BAUD_14400;
+		  break;
+#endif
+		  
+#if BAUD_VALID(19200, 16)
+		case '2':
+		  UBRRH = BAUD_19200>>8;		// set 19.2k Baud
+		  UBRRL = BAUD_19200;
+		  break;
+#endif
+
+#if BAUD_VALID(28800, 16)
+		case '3':
+		  UBRRH = BAUD_28800>>8;		// set 28.8k Baud
+		  UBRRL = BAUD_28800;
+		  break;
+#endif
+
+#if BAUD_VALID(38400, 16)
+		case '4':
+		  UBRRH = BAUD_38400>>8;		// set 38.4k Baud
+		  UBRRL = BAUD_38400;
+		  break;
+#endif
+
+#if BAUD_VALID(57600, 16)
+		case '5':
+		  UBRRH = BAUD_57600>>8;		// set 57.6k Baud
+		  UBRRL = BAUD_57600;
+		  break;
+#endif
+
+#if BAUD_VALID(230400, 8)
+		case '6':
+		  UCSRA |= _BV(U2X);  // double speed
+		  UBRRH = BAUD_230400_U2X>>8;		// set 230.4k Baud
+		  UBRRL = BAUD_230400_U2X;
+		  break;
+#endif
+
+#if BAUD_VALID(460800, 8)
+		case '7':
+		  UCSRA |= _BV(U2X);  // double speed
+		  UBRRH = BAUD_460800_U2X>>8;		// set 460.8k Baud
+		  UBRRL = BAUD_460800_U2X;
+		  break;
+#endif
+		
+		default:
+		  UBRRH = DEFAULT_BAUD>>8;		// set default baud rate
+		  UBRRL = DEFAULT_BAUD;
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Negotiated baud rate switch, ELM327 AT BRD style.
+**           Answer OK at the old rate, switch and send the ident string at
+**           the new rate, then wait for the host to confirm with a CR.
+**           Fall back to the old rate on timeout.
+**
+** Parameters: ASCII digit of baud rate, see AT Bx
+**
+** Returns: 0 = timeout, old baud rate restored
+**          1 = OK, new baud rate active
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t serial_negotiate_baud(char rate)
+{
+	char old_rate = serial_baud;  // save current rate for fall back
+	uint8_t time_count;
+
+	UCSRA |= _BV(TXC);  // clear transmit complete flag
+	serial_puts_P(PSTR("OK\r"));
+	if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	while( serial_tx_head != serial_tx_tail ) UCSRB |= _BV(UDRIE);  // flush Tx ring buffer
+	loop_until_bit_is_set(UCSRA, TXC);  // let the last char leave at the old rate
+
+	serial_set_baud(rate);
+	serial_puts_P(ident_txt);
+	serial_rx_tail = serial_rx_head;  // drop garbage received during the switch
+	if( CHECKBIT(serial_flow, FLOW_RX_STOP) ) serial_flow_go();
+
+	for(time_count = 0; time_count < BAUD_SWITCH_TIMEOUT; ++time_count)
+	{
+		timer1_start();
+		while(TCNT1 < us2cnt(1000))  // wait 1ms
+		{
+			while( serial_rx_head != serial_rx_tail )
+			{
+				uint8_t in_char = serial_rx_ring[serial_rx_tail];
+				serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_RING_SIZE - 1);
+				if(in_char == 0x0D)  // host is listening at the new rate
+				{
+					timer1_stop();
+					return J1850_RETURN_CODE_OK;
+				}
+			}
+		}
+	}
+	timer1_stop();
+
+	serial_set_baud(old_rate);  // no confirmation, host did not follow
+	return J1850_RETURN_CODE_UNKNOWN;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Save the current configuration to EEPROM, see AT WS.
+**           Monitor modes are not saved, the interface always boots to the
+**           command prompt.
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void config_save(void)
+{
+	config_t cfg;
+
+	cfg.version = CONFIG_VERSION;
+	cfg.parameter_bits = parameter_bits & ~(MON_RX|MON_TX|MON_OBH);
+	cfg.format_bits = format_bits;
+	memcpy(cfg.req_header, j1850_req_header, sizeof(cfg.req_header));
+	cfg.auto_recv_addr = auto_recv_addr;
+	cfg.timeout_multiplier = timeout_multiplier;
+	cfg.mon_receiver = mon_receiver;
+	cfg.mon_transmitter = mon_transmitter;
+	cfg.baud = serial_baud;
+	cfg.resp_cache_ttl = resp_cache_ttl;
+	cfg.crc = j1850_crc((uint8_t *)&cfg, sizeof(cfg) - 1);
+
+	eeprom_update_block(&cfg, &config_eeprom, sizeof(cfg));  // only changed bytes are written
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Load the configuration saved in EEPROM, see AT WL. Called at
+**           boot before the ident string so it is sent at the saved rate.
+**
+** Parameters: true to also switch to the saved baud rate, at boot only so
+**             the answer to AT WL is not garbled
+**
+** Returns: true when a valid configuration was loaded, false when none is
+**          saved or it does not match version and CRC, settings unchanged
+**
+**---------------------------------------------------------------------------
+*/
+bool config_load(bool with_baud)
+{
+	config_t cfg;
+
+	eeprom_read_block(&cfg, &config_eeprom, sizeof(cfg));
+	if( (cfg.version != CONFIG_VERSION) || (cfg.crc != j1850_crc((uint8_t *)&cfg, sizeof(cfg) - 1)) )
+		return false;  // erased, cleared or other layout
+
+	parameter_bits = cfg.parameter_bits;
+	format_bits = cfg.format_bits;
+	memcpy(j1850_req_header, cfg.req_header, sizeof(cfg.req_header));
+	auto_recv_addr = cfg.auto_recv_addr;
+	timeout_multiplier = cfg.timeout_multiplier;
+	mon_receiver = cfg.mon_receiver;
+	mon_transmitter = cfg.mon_transmitter;
+	resp_cache_ttl = cfg.resp_cache_ttl;
+	if( with_baud ) serial_set_baud(cfg.baud);
+	return true;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Classify a response frame against the request service id
+**
+** Parameters: Pointer to frame buffer, frame length including CRC,
+**             service id of the request
+**
+** Returns: RESP_POSITIVE = service id + 0x40
+**          RESP_NEGATIVE = 0x7F, service id, ..., negative response code
+**          RESP_PENDING  = negative response with code 0x78, response pending
+**          RESP_OTHER    = anything else
+**
+**---------------------------------------------------------------------------
+*/
+static uint8_t response_type(uint8_t *msg_buf, uint8_t nbytes, uint8_t sid)
+{
+	uint8_t hdr_len = CHECKBIT(parameter_bits, USE_OBH) ? 1 : 3;
+
+	if( nbytes < hdr_len + 2 ) return RESP_OTHER;  // no data byte
+
+	msg_buf += hdr_len;  // skip header bytes
+	nbytes -= hdr_len + 1;  // number of data bytes without CRC
+
+	if( *msg_buf == (uint8_t)(sid + 0x40) ) return RESP_POSITIVE;
+
+	if( (*msg_buf == 0x7F) && (nbytes >= 3) && (*(msg_buf+1) == sid) )
+	{  // negative response code is the last data byte
+		if( *(msg_buf+nbytes-1) == NRC_RESPONSE_PENDING ) return RESP_PENDING;
+		return RESP_NEGATIVE;
+	}
+
+	return RESP_OTHER;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Check if a new pipelined request to an address has to wait
+**
+** Parameters: receive address of the new request
+**
+** Returns: true when all slots are in use or a request to the same
+**          receive address is still in flight
+**
+**---------------------------------------------------------------------------
+*/
+bool pipeline_busy(uint8_t addr)
+{
+	if( pipe_pending >= PIPELINE_SLOTS ) return true;
+
+	for(uint8_t i = 0; i < PIPELINE_SLOTS; ++i)
+		if( pipe_slot[i].tag && (pipe_slot[i].addr == addr) ) return true;
+
+	return false;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Register a sent request as in flight and report its tag
+**
+** Parameters: receive address and service id of the request, time stamp
+**             at the end of the request
+**
+** Returns: J1850_RETURN_CODE_DATA, tag is sent as output
+**
+**---------------------------------------------------------------------------
+*/
+int8_t pipeline_add(uint8_t addr, uint8_t sid, uint16_t eof_time)
+{
+	uint8_t i;
+
+	for(i = 0; pipe_slot[i].tag; ++i);  // pipeline_busy() made sure there is a free slot
+
+	if( ++pipe_tag == 0 ) pipe_tag = 1;  // tag 0 marks a free slot
+	pipe_slot[i].addr = addr;
+	pipe_slot[i].sid = sid;
+	pipe_slot[i].time_count = 0;
+	pipe_slot[i].eof_time = eof_time;
+	pipe_slot[i].timed = false;
+	pipe_slot[i].tag = pipe_tag;
+	++pipe_pending;
+
+	pipeline_output(pipe_tag);
+	if(!CHECKBIT(parameter_bits, PACKED))
+	{// formated output with CR and optional LF
+		serial_putc('\r');
+		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	}
+	return J1850_RETURN_CODE_DATA;  // surpress any other output
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output the request tag prefix of a pipelined request
+**
+** Parameters: request tag
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void pipeline_output(uint8_t tag)
+{
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		serial_putc(MON_TAG_PIPE);
+		serial_putc(tag);
+	}
+	else
+	{
+		serial_putc('#');
+		serial_put_byte2ascii(tag);
+		serial_putc(' ');
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Match a received frame against the pipelined requests in
+**           flight, output it with its request tag and free the slot
+**
+** Parameters: Pointer to frame buffer, frame length including CRC
+**
+** Returns: true when the frame was consumed by a pipelined request
+**
+**---------------------------------------------------------------------------
+*/
+bool pipeline_match(uint8_t *msg_buf, int8_t nbytes)
+{
+	for(uint8_t i = 0; i < PIPELINE_SLOTS; ++i)
+	{
+		if( !pipe_slot[i].tag || (pipe_slot[i].addr != *(msg_buf+1)) ) continue;
+
+		uint8_t resp_type = response_type(msg_buf, nbytes, pipe_slot[i].sid);
+		if( (resp_type == RESP_OTHER) && CHECKBIT(parameter_bits, RESP_SID) ) return false;
+
+		if( !pipe_slot[i].timed )  // first answer, pending or final
+		{
+			latency_add(pipe_slot[i].addr, j1850_sof_time - pipe_slot[i].eof_time);
+			pipe_slot[i].timed = true;
+		}
+		if( resp_type == RESP_PENDING )
+		{
+			pipe_slot[i].time_count = 0;  // response pending, restart response timeout
+			return true;
+		}
+
+		pipeline_output(pipe_slot[i].tag);
+		monitor_output(msg_buf, nbytes, MON_TAG_PIPE);
+		pipe_slot[i].tag = 0;  // free slot
+		--pipe_pending;
+		return true;
+	}
+	return false;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Age pipelined requests after each receive call, report
+**           NO DATA for requests without response after 1000 calls
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void pipeline_tick(void)
+{
+	for(uint8_t i = 0; pipe_pending && (i < PIPELINE_SLOTS); ++i)
+	{
+		if( !pipe_slot[i].tag ) continue;
+
+		if( ++pipe_slot[i].time_count < 1000 ) continue;  // same timeout as a blocking request
+
+		pipeline_output(pipe_slot[i].tag);
+		if(CHECKBIT(parameter_bits, PACKED))
+			serial_putc(0x00);  // length byte
+		else
+		{
+			serial_puts_P(no_data_txt);
+			if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+		}
+		pipe_slot[i].tag = 0;  // free slot
+		--pipe_pending;
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Compare the leading bytes of a frame with a pattern
+**
+** Parameters: Pointer to frame buffer, frame length including CRC,
+**             FRAME_MATCH_LEN pattern bytes and mask bytes
+**
+** Returns: true when all bits set in the mask are equal, a frame too short
+**          only matches when the mask of the missing bytes is 0
+**
+**---------------------------------------------------------------------------
+*/
+bool frame_match(uint8_t *msg_buf, int8_t nbytes, uint8_t *match, uint8_t *mask)
+{
+	for(uint8_t k = 0; k < FRAME_MATCH_LEN; ++k)
+	{
+		if( k < nbytes-1 )
+		{
+			if( (*(msg_buf+k) ^ match[k]) & mask[k] ) return false;
+		}
+		else if( mask[k] ) return false;
+	}
+	return true;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: ECU emulation, answer a received request from the responder
+**           table. The first matching entry is sent right away so the
+**           response lands well inside the J1850 response window.
+**
+** Parameters: Pointer to request frame, frame length including CRC,
+**             pointer to a 12 byte buffer for the response frame
+**
+** Returns: length of the sent response including CRC, 0 = not answered
+**
+**---------------------------------------------------------------------------
+*/
+int8_t ecu_respond(uint8_t *msg_buf, int8_t nbytes, uint8_t *resp_buf)
+{
+	uint8_t hdr_len = CHECKBIT(parameter_bits, USE_OBH) ? 1 : 3;
+	uint8_t i, k, len;
+
+	if( nbytes < 2 ) return 0;
+	if( *(msg_buf+(nbytes-1)) != j1850_crc(msg_buf, nbytes-1) ) return 0;  // never answer a corrupted request
+
+	for(i = 0; i < ECU_ENTRIES; ++i)
+	{
+		ecu_entry_t *e = &ecu_entry[i];
+
+		if( !e->resp_len || !frame_match(msg_buf, nbytes, e->match, e->mask) ) continue;
+
+		// response header and service id from the template
+		for(len = 0; (len < e->resp_len) && (len <= hdr_len); ++len)
+			resp_buf[len] = e->resp[len];
+
+		// echo request parameters, e.g. the PID, behind the response service id
+		for(k = hdr_len+1; (k < nbytes-1) && (k < hdr_len+1 + e->echo); ++k)
+			resp_buf[len++] = *(msg_buf+k);
+
+		// remaining template bytes, e.g. the value
+		for(k = hdr_len+1; k < e->resp_len; ++k)
+			resp_buf[len++] = e->resp[k];
+
+		resp_buf[len] = j1850_crc(resp_buf, len);
+		++len;
+
+		if( j1850_send_msg(resp_buf, len, CHECKBIT(parameter_bits, MSG_LEN)) != J1850_RETURN_CODE_OK )
+			return 0;
+		return len;
+	}
+	return 0;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Add a responder table entry, see AT UA
+**
+** Parameters: Pointer to the parameters following "atua":
+**             echo count digit, 4 match bytes, 4 mask bytes, 1..8 response
+**             template bytes, all as ASCII hex
+**
+** Returns: J1850_RETURN_CODE_OK, or J1850_RETURN_CODE_UNKNOWN on syntax
+**          error or full table
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t ecu_add(char *param)
+{
+	uint8_t param_len = strlen(param);
+	uint8_t resp_len = (param_len - 1 - 4*FRAME_MATCH_LEN) / 2;
+	uint8_t echo = *param - '0';
+	uint8_t i, k;
+
+	if( (param_len < 3 + 4*FRAME_MATCH_LEN) || !(param_len & 1) || (resp_len > ECU_RESP_MAX) )
+		return J1850_RETURN_CODE_UNKNOWN;
+	if( (echo > 8) || (resp_len + echo > 11) )  // response must fit in 12 bytes with CRC
+		return J1850_RETURN_CODE_UNKNOWN;
+	for(k = 1; k < param_len; ++k)
+		if( !isxdigit(*(param+k)) ) return J1850_RETURN_CODE_UNKNOWN;
+
+	for(i = 0; ecu_entry[i].resp_len; )
+		if( ++i >= ECU_ENTRIES ) return J1850_RETURN_CODE_UNKNOWN;  // table full
+
+	++param;  // skip echo count
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		ecu_entry[i].match[k] = ascii2byte(param);
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		ecu_entry[i].mask[k] = ascii2byte(param);
+	for(k = 0; k < resp_len; ++k, param += 2)
+		ecu_entry[i].resp[k] = ascii2byte(param);
+	ecu_entry[i].echo = echo;
+	ecu_entry[i].resp_len = resp_len;  // entry becomes active last
+	++ecu_entries;
+
+	return J1850_RETURN_CODE_OK;
+}
+
+#if J1850_CHANNELS > 1
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Gateway, send a frame received on one J1850 channel on the
+**           other one, right after its EOF. Frames with a wrong CRC are
+**           not forwarded. With an empty filter table all frames pass,
+**           otherwise the first entry matching the frame and direction.
+**
+** Parameters: Pointer to frame buffer, frame length including CRC
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void gateway_forward(uint8_t *msg_buf, int8_t nbytes)
+{
+	uint8_t src = j1850_channel;
+	uint8_t dir = src ? GATEWAY_B_TO_A : GATEWAY_A_TO_B;
+	uint8_t i;
+
+	if( (nbytes < 2) || (*(msg_buf+nbytes-1) != j1850_crc(msg_buf, nbytes-1)) ) return;
+
+	if( gateway_entries )
+	{
+		for(i = 0; i < GATEWAY_ENTRIES; ++i)
+			if( (gateway_entry[i].dir & dir) && frame_match(msg_buf, nbytes, gateway_entry[i].match, gateway_entry[i].mask) )
+				break;
+		if( i >= GATEWAY_ENTRIES ) return;  // no entry for this frame
+	}
+
+	j1850_select(!src);
+	j1850_send_msg(msg_buf, nbytes, false);  // CRC is sent as received
+	j1850_select(src);  // answers of the ECU emulation go back to the source
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Add a gateway filter entry, AT GA d mmmmmmmm kkkkkkkk
+**
+** Parameters: Pointer to parameter string, direction digit 1 = first to
+**             second channel, 2 = second to first, 3 = both, then
+**             match and mask as hex
+**
+** Returns: J1850_RETURN_CODE_OK, or J1850_RETURN_CODE_UNKNOWN on syntax
+**          error or full table
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t gateway_add(char *param)
+{
+	uint8_t dir = *param - '0';
+	uint8_t i, k;
+
+	if( (strlen(param) != 1 + 4*FRAME_MATCH_LEN) || (dir < 1) || (dir > 3) )
+		return J1850_RETURN_CODE_UNKNOWN;
+	for(k = 1; *(param+k); ++k)
+		if( !isxdigit(*(param+k)) ) return J1850_RETURN_CODE_UNKNOWN;
+
+	for(i = 0; gateway_entry[i].dir; )
+		if( ++i >= GATEWAY_ENTRIES ) return J1850_RETURN_CODE_UNKNOWN;  // table full
+
+	++param;  // skip direction
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		gateway_entry[i].match[k] = ascii2byte(param);
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		gateway_entry[i].mask[k] = ascii2byte(param);
+	gateway_entry[i].dir = dir;  // entry becomes active last
+	++gateway_entries;
+
+	return J1850_RETURN_CODE_OK;
+}
+#endif
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Latest value cache, keep the data of a received frame when its
+**           header is registered. Frames with a wrong CRC are ignored.
+**
+** Parameters: Pointer to frame buffer, frame length including CRC
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void cache_update(uint8_t *msg_buf, int8_t nbytes)
+{
+	if( (nbytes < 4) || (*(msg_buf+nbytes-1) != j1850_crc(msg_buf, nbytes-1)) ) return;
+
+	for(cache_entry_t *e = cache_entry; e < &cache_entry[cache_entries]; ++e)
+	{
+		if( memcmp(e->header, msg_buf, 3) ) continue;
+
+		uint8_t len = nbytes - 4;  // without header and CRC
+		if( len > CACHE_DATA_MAX ) len = CACHE_DATA_MAX;
+		memcpy(e->data, msg_buf+3, len);
+		e->len = len;
+		e->time = time_base_coarse();
+		return;
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Hold the age of old latest value cache entries at CACHE_AGE_MAX.
+**           Called from the main loop so an age never wraps and a stale
+**           value does not show as recent.
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void cache_age_limit(void)
+{
+	uint16_t now = time_base_coarse();
+
+	for(cache_entry_t *e = cache_entry; e < &cache_entry[cache_entries]; ++e)
+		if( (e->len != CACHE_NO_DATA) && ((uint16_t)(now - e->time) > CACHE_AGE_MAX) )
+			e->time = now - CACHE_AGE_MAX;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Find the cache entry of a header given as 6 hex chars
+**
+** Parameters: Pointer to parameter string
+**
+** Returns: pointer to the entry, NULL if the header is not registered or
+**          the parameter is no header
+**
+**---------------------------------------------------------------------------
+*/
+static cache_entry_t *cache_find(char *param)
+{
+	uint8_t header[3];
+
+	if( strlen(param) != 6 ) return NULL;
+	for(uint8_t k = 0; k < 6; ++k)
+		if( !isxdigit(*(param+k)) ) return NULL;
+	for(uint8_t k = 0; k < 3; ++k, param += 2)
+		header[k] = ascii2byte(param);
+
+	for(cache_entry_t *e = cache_entry; e < &cache_entry[cache_entries]; ++e)
+		if( !memcmp(e->header, header, 3) ) return e;
+	return NULL;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Register a header in the latest value cache, AT VA hhhhhh
+**
+** Parameters: Pointer to parameter string
+**
+** Returns: J1850_RETURN_CODE_OK, or J1850_RETURN_CODE_UNKNOWN on syntax
+**          error or full table
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t cache_add(char *param)
+{
+	cache_entry_t *e = &cache_entry[cache_entries];
+
+	if( (strlen(param) != 6) || (cache_entries >= CACHE_ENTRIES) ) return J1850_RETURN_CODE_UNKNOWN;
+	for(uint8_t k = 0; k < 6; ++k)
+		if( !isxdigit(*(param+k)) ) return J1850_RETURN_CODE_UNKNOWN;
+	if( cache_find(param) ) return J1850_RETURN_CODE_OK;  // already registered
+
+	for(uint8_t k = 0; k < 3; ++k, param += 2)
+		e->header[k] = ascii2byte(param);
+	e->len = CACHE_NO_DATA;
+	++cache_entries;  // entry becomes active last
+
+	return J1850_RETURN_CODE_OK;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output one cache entry, age in coarse time base ticks
+**           (8.9ms) up to CACHE_AGE_MAX, CACHE_AGE_NONE when not
+**           received yet, then the header and the data bytes
+**
+** Parameters: Pointer to entry, show header, show data
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void cache_output(cache_entry_t *e, bool header, bool data)
+{
+	uint16_t age = CACHE_AGE_NONE;
+
+	if( e->len != CACHE_NO_DATA )
+	{
+		age = time_base_coarse() - e->time;
+		if( age > CACHE_AGE_MAX ) age = CACHE_AGE_MAX;  // not limited by the main loop yet
+	}
+	serial_put_byte2ascii(age >> 8);
+	serial_put_byte2ascii(age);
+
+	for(uint8_t k = 0; header && (k < 3); ++k)
+	{
+		serial_putc(' ');
+		serial_put_byte2ascii(e->header[k]);
+	}
+	for(uint8_t k = 0; data && (e->len != CACHE_NO_DATA) && (k < e->len); ++k)
+	{
+		serial_putc(' ');
+		serial_put_byte2ascii(e->data[k]);
+	}
+	serial_putc('\r');
+	if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output one signal value, MON_TAG_SIG, signal number and the
+**           value in as many bytes as the field needs, high byte first.
+**           Formatted output is "Snn vvvv".
+**
+** Parameters: Signal number
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void signal_output(uint8_t k)
+{
+	signal_entry_t *e = &signal_entry[k];
+	uint8_t n = ((e->len & ~SIGNAL_LE) + 7) / 8;  // value bytes
+
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		serial_putc(MON_TAG_SIG);
+		serial_putc(k);
+		while(n--) serial_putc(e->value >> (8*n));
+		return;
+	}
+
+	serial_putc(pgm_read_byte(&mon_tag_txt[MON_TAG_SIG & 0x0F]));
+	serial_put_byte2ascii(k);
+	serial_putc(' ');
+	while(n--) serial_put_byte2ascii(e->value >> (8*n));
+	serial_putc('\r');
+	if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Signal extraction, take the registered fields out of a
+**           received frame and send the ones with a changed value while
+**           the stream is on. Frames with a wrong CRC or too short for a
+**           field are ignored.
+**
+** Parameters: Pointer to frame buffer, frame length including CRC
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void signal_update(uint8_t *msg_buf, int8_t nbytes)
+{
+	if( (nbytes < 4) || (*(msg_buf+nbytes-1) != j1850_crc(msg_buf, nbytes-1)) ) return;
+
+	for(uint8_t k = 0; k < signal_entries; ++k)
+	{
+		signal_entry_t *e = &signal_entry[k];
+		uint8_t bits = e->len & ~SIGNAL_LE;
+		uint8_t n = (bits + e->shift + 7) / 8;  // field bytes
+		uint8_t *p = msg_buf + 3 + e->offset;
+		uint32_t value = 0;
+
+		if( memcmp(e->header, msg_buf, 3) || (e->offset + n > nbytes - 4) ) continue;
+
+		for(uint8_t i = 0; i < n; ++i)
+			value = (value << 8) | ((e->len & SIGNAL_LE) ? *(p+n-1-i) : *(p+i));
+		value >>= e->shift;
+		if( bits < 32 ) value &= ((uint32_t)1 << bits) - 1;
+
+		if( (e->state & SIGNAL_VALID) && (value == e->value) && ((e->state & SIGNAL_SENT) || !signal_stream) ) continue;
+		e->value = value;
+		e->state |= SIGNAL_VALID;
+		if( signal_stream )
+		{
+			signal_output(k);
+			e->state |= SIGNAL_SENT;
+		}
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Register a signal, AT XA hhhhhh oo ll [ss]
+**           header, byte offset after the header, length in bits with
+**           SIGNAL_LE set for little endian, optional shift in bits
+**
+** Parameters: Pointer to parameter string
+**
+** Returns: J1850_RETURN_CODE_OK, or J1850_RETURN_CODE_UNKNOWN on syntax
+**          error, bad field or full table
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t signal_add(char *param)
+{
+	signal_entry_t *e = &signal_entry[signal_entries];
+	uint8_t len = strlen(param);
+
+	if( ((len != 10) && (len != 12)) || (signal_entries >= SIGNAL_ENTRIES) ) return J1850_RETURN_CODE_UNKNOWN;
+	for(uint8_t k = 0; k < len; ++k)
+		if( !isxdigit(*(param+k)) ) return J1850_RETURN_CODE_UNKNOWN;
+
+	for(uint8_t k = 0; k < 3; ++k, param += 2)
+		e->header[k] = ascii2byte(param);
+	e->offset = ascii2byte(param);
+	e->len = ascii2byte(param+2);
+	e->shift = (len == 12) ? ascii2byte(param+4) : 0;
+	e->state = 0;
+
+	len = e->len & ~SIGNAL_LE;
+	if( !len || (len + e->shift > SIGNAL_BITS_MAX) ) return J1850_RETURN_CODE_UNKNOWN;
+	++signal_entries;  // entry becomes active last
+
+	return J1850_RETURN_CODE_OK;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: List the signal table, signal number, header, offset, length,
+**           shift and the last value when received
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void signal_list(void)
+{
+	for(uint8_t k = 0; k < signal_entries; ++k)
+	{
+		signal_entry_t *e = &signal_entry[k];
+
+		serial_put_byte2ascii(k);
+		for(uint8_t i = 0; i < 3; ++i)
+		{
+			serial_putc(' ');
+			serial_put_byte2ascii(e->header[i]);
+		}
+		serial_putc(' ');
+		serial_put_byte2ascii(e->offset);
+		serial_putc(' ');
+		serial_put_byte2ascii(e->len);
+		serial_putc(' ');
+		serial_put_byte2ascii(e->shift);
+		if( e->state & SIGNAL_VALID )
+		{
+			serial_putc(' ');
+			for(uint8_t n = ((e->len & ~SIGNAL_LE) + 7) / 8; n--; )
+				serial_put_byte2ascii(e->value >> (8*n));
+		}
+		serial_putc('\r');
+		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+	}
+}
+
 /*
 **---------------------------------------------------------------------------
 **
-** Abstract: Main routine
+** Abstract: Record a received frame in the capture buffer. While armed
+**           only the last pre-trigger frames are kept, after the trigger
+**           frame the post-trigger frames are added, then the buffer is
+**           frozen until it is dumped.
+**
+** Parameters: frame pool slot with the frame length set, the capture
+**             owns the slot from now on
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void capture_frame(uint8_t slot)
+{
+	uint8_t *msg_buf = frame_data(slot);
+	uint8_t nbytes = frame_pool[slot].len;
+
+	frame_release(capture_slot[capture_head]);  // frame dropping out of the circular buffer
+	capture_slot[capture_head] = slot;
+
+	if( capture_state == CAPTURE_ARMED )
+	{
+		if( frame_match(msg_buf, nbytes, capture_match, capture_mask) )
+		{
+			capture_trig = capture_head;
+			++capture_count;
+			capture_state = capture_post ? CAPTURE_TRIGGERED : CAPTURE_DONE;
+		}
+		else if( capture_count < capture_pre )
+			++capture_count;  // otherwise the oldest pre-trigger frame drops out
+	}
+	else
+	{
+		++capture_count;  // pre + 1 + post fit into the buffer
+		if( !--capture_post ) capture_state = CAPTURE_DONE;
+	}
+	capture_head = (capture_head + 1) & (CAPTURE_SLOTS - 1);
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Hand a received frame to the trigger capture while it records,
+**           the owner of the frame goes on with a fresh slot. The frame
+**           itself stays valid until the capture wraps around.
+**
+** Parameters: slot of the received frame, frame length including CRC
+**
+** Returns: slot the owner keeps, the same slot when nothing was captured
+**
+**---------------------------------------------------------------------------
+*/
+uint8_t capture_take(uint8_t slot, int8_t nbytes)
+{
+	uint8_t fresh;
+
+	if( !is_capturing() || (nbytes <= 0) ) return slot;  // nothing received after SOF
+	if( (fresh = frame_alloc()) == FRAME_NONE ) return slot;  // frame not captured
+
+	frame_pool[slot].len = nbytes;
+	capture_frame(slot);
+	return fresh;
+}
+
+/*
+**---------------------------------------------------------------------------
 **
+** Abstract: Stop capturing and give all captured frames back to the pool
 **
 ** Parameters: none
 **
+** Returns: none
 **
-** Returns: NULL
+**---------------------------------------------------------------------------
+*/
+void capture_clear(void)
+{
+	capture_state = CAPTURE_OFF;
+	capture_count = 0;
+	for(uint8_t i = 0; i < CAPTURE_SLOTS; ++i)
+	{
+		frame_release(capture_slot[i]);
+		capture_slot[i] = FRAME_NONE;
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Arm the trigger capture, see AT TA
+**
+** Parameters: Pointer to the parameters following "atta": pre-trigger and
+**             post-trigger frame count, 4 trigger bytes and 4 mask bytes,
+**             all as ASCII hex
 **
+** Returns: J1850_RETURN_CODE_OK, or J1850_RETURN_CODE_UNKNOWN on syntax
+**          error or counts not fitting into the capture buffer
 **
 **---------------------------------------------------------------------------
 */
-// main routine
-int16_t main( void )
+static int8_t capture_arm(char *param)
 {
-	wdt_disable();	// make sure the watchdog is not running
-	UBRRH = DEFAULT_BAUD>>8;		// set baud rate
-	UBRRL = DEFAULT_BAUD;
-	UCSRB =((1<<RXCIE)|(1<<RXEN)|(1<<TXEN));	// enable Rx & Tx, enable Rx interrupt
-	UCSRC =((1<<URSEL)|(1<<UCSZ1)|(1<<UCSZ0));	// config USART; 8N1
-	serial_msg_pntr = &serial_msg_buf[0];  // init serial msg pointer
-	
-	j1850_init();	// init J1850 bus
+	uint8_t k;
 
-	ident();	// send identification to terminal
+	if( strlen(param) != 4 + 4*FRAME_MATCH_LEN ) return J1850_RETURN_CODE_UNKNOWN;
+	for(k = 0; *(param+k); ++k)
+		if( !isxdigit(*(param+k)) ) return J1850_RETURN_CODE_UNKNOWN;
 
-	serial_putc('>');  // send initial command prompt
+	capture_clear();  // background receive ignores the buffer meanwhile
+	capture_pre = ascii2byte(param);
+	capture_post = ascii2byte(param+2);
+	if( (uint16_t)capture_pre + capture_post >= CAPTURE_SLOTS ) return J1850_RETURN_CODE_UNKNOWN;
 
-	sei();	// enable global interrupts
+	param += 4;
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		capture_match[k] = ascii2byte(param);
+	for(k = 0; k < FRAME_MATCH_LEN; ++k, param += 2)
+		capture_mask[k] = ascii2byte(param);
 
-	for(;;)
+	capture_state = CAPTURE_ARMED;
+	return J1850_RETURN_CODE_OK;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Output the captured frames oldest first in monitor format,
+**           the trigger frame is tagged, then stop capturing
+**
+** Parameters: none
+**
+** Returns: J1850_RETURN_CODE_DATA, or J1850_RETURN_CODE_NO_DATA when the
+**          buffer is empty
+**
+**---------------------------------------------------------------------------
+*/
+static int8_t capture_dump(void)
+{
+	uint8_t slot = (capture_head - capture_count) & (CAPTURE_SLOTS - 1);
+	uint8_t count = capture_count;
+	bool triggered = (capture_state == CAPTURE_TRIGGERED) || (capture_state == CAPTURE_DONE);
+
+	capture_state = CAPTURE_OFF;
+	if( !count )
 	{
-		while( CHECKBIT(parameter_bits, MON_RX) || CHECKBIT(parameter_bits, MON_TX) || CHECKBIT(parameter_bits, MON_OBH))
-		{
-			uint8_t j1850_msg_buf[12];  // J1850 message buffer
-			uint8_t *j1850_msg_pntr = &j1850_msg_buf[0];  //  msg pointer
-			int8_t recv_nbytes;  // byte counter		
-      
-			recv_nbytes = j1850_recv_msg(j1850_msg_buf, CHECKBIT(parameter_bits, MSG_LEN));	// get J1850 frame
-		
-			if( !(recv_nbytes & 0x80) ) // proceed only with no errors
-			{
-				j1850_msg_pntr = &j1850_msg_buf[0];
-			
-				// check for respond from correct addr or monitor all mode
-				if( (CHECKBIT(parameter_bits, MON_RX) && CHECKBIT(parameter_bits, MON_TX))
-				    ||
-					((mon_receiver == *(j1850_msg_pntr+1)) && CHECKBIT(parameter_bits, MON_RX) )
-					||
-					((mon_transmitter == *(j1850_msg_pntr+2)) && CHECKBIT(parameter_bits, MON_TX) )
-					||
-					((mon_transmitter == *(j1850_msg_pntr)) && CHECKBIT(parameter_bits, MON_OBH) )
-					)
-				{
-					// surpess CRC and header bytes output
-					if( !CHECKBIT(parameter_bits, HEADER) )
-					{ 
-						if( CHECKBIT(parameter_bits, MON_OBH) ||  // check if one byte header frames are used
-							CHECKBIT(parameter_bits, USE_OBH)
-						   )
-						{
-						  recv_nbytes -= 2;  // discard 1st header byte and CRC
-						  j1850_msg_pntr += 1;  // skip header byte
-						}
-						else
-						{
-						  recv_nbytes -= 4;  // discard 3 header bytes and CRC
-						  j1850_msg_pntr += 3;  // skip 3 header bytes
-						}
-					}
+		capture_clear();
+		return J1850_RETURN_CODE_NO_DATA;
+	}
 
-					if(CHECKBIT(parameter_bits, PACKED))
-					{ // check respond CRC
-						if( *(j1850_msg_pntr+(recv_nbytes-1)) == j1850_crc(j1850_msg_buf, recv_nbytes-1) )
-							serial_putc(recv_nbytes);  // length byte
-						else
-							serial_putc(recv_nbytes&0x80);  // length byte with error indicator set
-					}
-     
-					// output response data
-					for(;recv_nbytes > 0; recv_nbytes--)
-					{
-						if(CHECKBIT(parameter_bits, PACKED))
-							serial_putc(*j1850_msg_pntr++);  // data byte
-						else
-						{
-							serial_put_byte2ascii(*j1850_msg_pntr++);
-							serial_putc(' ');
-						}
-					}
-     			
-					if(!CHECKBIT(parameter_bits, PACKED))
-					{// formated output with CR and optional LF
-						serial_putc('\r');
-						if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					}					
-					
-				}  // end if valid monitoring addr
-			} // end if message recv
-		} // end while monitoring active
-	}	// endless loop
-	
-	return 0;
-} // end of main()
+	for(; count; --count)
+	{
+		uint8_t frame = capture_slot[slot];
+		monitor_output(frame_data(frame), frame_pool[frame].len,
+					   (triggered && (slot == capture_trig)) ? MON_TAG_TRIG : MON_TAG_NONE);
+		slot = (slot + 1) & (CAPTURE_SLOTS - 1);
+	}
+	capture_clear();
+	return J1850_RETURN_CODE_DATA;
+}
 
 /*
 **---------------------------------------------------------------------------
 **
-** Abstract: Send program ident string to terminal
-**
+** Abstract: Response cache time to live in coarse time base ticks
 **
 ** Parameters: none
 **
+** Returns: AT CT seconds in time_base_coarse() ticks (8.9ms @ 7,3728MHz)
+**
+**---------------------------------------------------------------------------
+*/
+static uint16_t resp_cache_ticks(void)
+{
+	uint32_t ticks = (uint32_t)resp_cache_ttl * (MCU_XTAL / 256UL) / 256UL;
+	return (ticks > 0xFFFF) ? 0xFFFF : ticks;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Free the response cache entries older than the time to live.
+**           Called from the main loop so no entry survives a wrap of the
+**           coarse time base and looks fresh again.
+**
+** Parameters: none
 **
 ** Returns: none
 **
+**---------------------------------------------------------------------------
+*/
+void resp_cache_expire(void)
+{
+	if( !resp_cache_ttl ) return;
+
+	uint16_t now = time_base_coarse();
+	uint16_t ttl = resp_cache_ticks();
+	for(resp_cache_entry_t *e = resp_cache_entry; e < &resp_cache_entry[RESP_CACHE_ENTRIES]; ++e)
+		if( e->req_len && ((uint16_t)(now - e->time) >= ttl) ) e->req_len = 0;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Find the fresh cached response of a request
+**
+** Parameters: Pointer to request frame, length without CRC, receive address
+**
+** Returns: pointer to the entry, NULL if the request is not cached or its
+**          response is older than the time to live
 **
 **---------------------------------------------------------------------------
 */
-void ident(void)
+static resp_cache_entry_t *resp_cache_find(uint8_t *req, uint8_t req_len, uint8_t recv_addr)
 {
-	serial_puts_P(ident_txt);  // show code description
+	uint16_t now = time_base_coarse();
+	uint16_t ttl = resp_cache_ticks();
+
+	for(resp_cache_entry_t *e = resp_cache_entry; e < &resp_cache_entry[RESP_CACHE_ENTRIES]; ++e)
+	{
+		if( (e->req_len != req_len) || (e->recv_addr != recv_addr) || memcmp(e->req, req, req_len) ) continue;
+		return ((uint16_t)(now - e->time) < ttl) ? e : NULL;
+	}
+	return NULL;
 }
 
 /*
 **---------------------------------------------------------------------------
 **
-** Abstract: Convert 2 byte ASCII hex to 1 byte decimal
+** Abstract: Keep the positive response of a request, replaces the entry
+**           of the same request, else a free one, else the oldest one
 **
+** Parameters: Pointer to request frame, length without CRC, receive
+**             address, pointer to response frame, length including CRC
 **
-** Parameters: Pointer to first ASCII char
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void resp_cache_store(uint8_t *req, uint8_t req_len, uint8_t recv_addr, uint8_t *resp, uint8_t resp_len)
+{
+	uint16_t now = time_base_coarse();
+	resp_cache_entry_t *e = resp_cache_entry;
+
+	if( (req_len > RESP_CACHE_REQ_MAX) || (resp_len > RESP_CACHE_RESP_MAX) ) return;
+
+	for(resp_cache_entry_t *k = resp_cache_entry; k < &resp_cache_entry[RESP_CACHE_ENTRIES]; ++k)
+	{
+		if( (k->req_len == req_len) && (k->recv_addr == recv_addr) && !memcmp(k->req, req, req_len) )
+		{
+			e = k;
+			break;
+		}
+		if( !e->req_len ) continue;  // keep the first free entry
+		if( !k->req_len || ((uint16_t)(now - k->time) > (uint16_t)(now - e->time)) ) e = k;
+	}
+
+	memcpy(e->req, req, req_len);
+	e->recv_addr = recv_addr;
+	memcpy(e->resp, resp, resp_len);
+	e->resp_len = resp_len;
+	e->time = now;
+	e->req_len = req_len;
+}
+
+/*
+**---------------------------------------------------------------------------
 **
+** Abstract: Output the response to a request, inline and tagged in
+**           continuous monitor mode, otherwise without header and CRC
+**           unless headers are on
 **
-** Returns: decimal value
+** Parameters: Pointer to frame buffer, frame length including CRC,
+**             MON_TAG_NEG for a negative response or MON_TAG_NONE
 **
+** Returns: J1850_RETURN_CODE_DATA
 **
 **---------------------------------------------------------------------------
 */
-static uint8_t ascii2byte(char *val)
+static int8_t response_output(uint8_t *msg_buf, uint8_t nbytes, uint8_t tag)
 {
-	uint8_t temp = *val;
-	
-	if(temp > 0x60) temp -= 39;  // convert chars a-f
-	temp -= 48;  // convert chars 0-9
-	temp *= 16;
-	
-	temp += *(val+1);
-	if(*(val+1) > 0x60) temp -= 39;  // convert chars a-f
-	temp -= 48;  // convert chars 0-9	
+	if( is_monitoring() && CHECKBIT(parameter_bits, MON_CONT) )
+	{
+		monitor_output(msg_buf, nbytes, tag ? tag : MON_TAG_RESP);  // tagged response inline
+		return J1850_RETURN_CODE_DATA;  // surpress any other output
+	}
 
-	return temp;
+	if( !CHECKBIT(parameter_bits, HEADER) )
+	{
+		if(CHECKBIT(parameter_bits, USE_OBH) )  // check if one byte header frames are used
+		{
+			nbytes -= 2;  // discard 1st header byte and CRC
+			msg_buf += 1;  // skip header byte
+		}
+		else
+		{
+			nbytes -= 4;  // discard 3 header bytes and CRC
+			msg_buf += 3;  // skip 3 header bytes
+		}
+	}
+
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		if(tag) serial_putc(tag);  // tag byte ahead of length byte
+		serial_putc(nbytes);  // length byte
+	}
+	else if(tag)
+	{
+		serial_putc(pgm_read_byte(&mon_tag_txt[tag & 0x0F]));
+		serial_putc(' ');
+	}
 
+	// output response data
+	if(CHECKBIT(parameter_bits, PACKED))
+	{
+		for(;nbytes > 0; --nbytes)
+			serial_putc(*msg_buf++);  // data byte
+	}
+	else
+		serial_put_frame2ascii(msg_buf, nbytes);  // formated output with CR and optional LF
+	return J1850_RETURN_CODE_DATA;  // surpress any other output
 }
 
 /*
@@ -245,7 +2053,8 @@ int8_t serial_processing(void)
   	uint8_t *var_pntr = 0;  // point to different variables
 	
 	uint8_t j1850_msg_len = (serial_msg_len - 4) / 2;	
-	uint8_t j1850_msg_buf[12];  // J1850 message to be send
+	uint8_t *j1850_msg_buf = frame_data(frame_request);  // J1850 message to be send or received
+	uint8_t return_code;  // J1850 send return code
 
 	if( (*(serial_msg_pntr)=='a') && (*(serial_msg_pntr+1)=='t'))  // check for "at" or hex
 	{  // is AT command
@@ -261,61 +2070,59 @@ int8_t serial_processing(void)
 				return J1850_RETURN_CODE_OK ;
 
 			case 'b':  // set Baud rate
-				if( isdigit(*(serial_msg_pntr+3)) )
+				if( isdigit(*(serial_msg_pntr+3)) && (BAUD_RATES_VALID & _BV(*(serial_msg_pntr+3) - '0')) )
 				{
-				  switch(*(serial_msg_pntr+3))
-				  {
-					case '0':
-					  UBRRH = BAUD_9600>>8;		// set 9600 Baud
-					  UBRRL = BAUD_9600;
-					  break;
-
-					case '1':
-					  UBRRH = BAUD_14400>>8;		// set 14.4k Baud
-					  UBRRL = BAUD_14400;
-					  break;
-					  
-					case '2':
-					  UBRRH = BAUD_19200>>8;		// set 19.2k Baud
-					  UBRRL = BAUD_19200;
-					  break;
-
-					case '3':
-					  UBRRH = BAUD_28800>>8;		// set 28.8k Baud
-					  UBRRL = BAUD_28800;
-					  break;
-
-					case '4':
-					  UBRRH = BAUD_38400>>8;		// set 38.4k Baud
-					  UBRRL = BAUD_38400;
-					  break;
-
-					case '5':
-					  UBRRH = BAUD_57600>>8;		// set 57.6k Baud
-					  UBRRL = BAUD_57600;
-					  break;
-					
-					default:
-					  UBRRH = DEFAULT_BAUD>>8;		// set default baud rate
-					  UBRRL = DEFAULT_BAUD;
-				  }
+				  serial_set_baud(*(serial_msg_pntr+3));
 				  return J1850_RETURN_CODE_OK ;
 				}
+				if( (*(serial_msg_pntr+3) == 'n') && isdigit(*(serial_msg_pntr+4)) && (BAUD_RATES_VALID & _BV(*(serial_msg_pntr+4) - '0')) )
+					return serial_negotiate_baud(*(serial_msg_pntr+4));  // negotiated switch
 				return J1850_RETURN_CODE_UNKNOWN; 
 			
-			case 'c':  // message length check on/off
+			case 'c':  // message length check on/off, or response cache time to live or clear
+				if( *(serial_msg_pntr+3) == 't' )
+				{
+					if( (serial_msg_len != 6) || !isxdigit(*(serial_msg_pntr+4)) || !isxdigit(*(serial_msg_pntr+5)) )
+						return J1850_RETURN_CODE_UNKNOWN;
+					resp_cache_ttl = ascii2byte(serial_msg_pntr+4);
+					memset(resp_cache_entry, 0, sizeof(resp_cache_entry));  // start empty with the new time to live
+					return J1850_RETURN_CODE_OK;
+				}
+				if( *(serial_msg_pntr+3) == 'c' )
+				{
+					memset(resp_cache_entry, 0, sizeof(resp_cache_entry));
+					return J1850_RETURN_CODE_OK;
+				}
 				if (*(serial_msg_pntr + 3) == '0')
 					CLEARBIT(parameter_bits, MSG_LEN);
 				else
 					SETBIT(parameter_bits, MSG_LEN);
 				return J1850_RETURN_CODE_OK;
 
-			case 'd':  // set defaults
-				parameter_bits = HEADER|RESPONSE|AUTO_RECV;
+			case 'd':  // set defaults, keep flow control of the serial link
+				parameter_bits = (parameter_bits & (FLOW_HW|FLOW_SW)) | HEADER|RESPONSE|AUTO_RECV;
+				format_bits = SPACES|PROMPT;
 				timeout_multiplier = 0x19;	// set default timeout to 4ms * 25 = 100ms
 				j1850_req_header[0] = 0x68;  // Prio 3, Functional Adressing
 				j1850_req_header[1] = 0x6A;  // Target legislated diagnostic
 				j1850_req_header[2] = 0xF1;  // Frame source = Diagnostic Tool
+				memset(ecu_entry, 0, sizeof(ecu_entry));  // ECU emulation off
+				ecu_entries = 0;
+				capture_clear();  // trigger capture off
+				cache_entries = 0;  // latest value cache off
+				signal_entries = 0;  // signal extraction off
+				signal_stream = false;
+				j1850_rx_adapt = false;  // fixed receive thresholds
+				j1850_glitch_ticks = us2cnt(J1850_GLITCH_US);
+				resp_cache_ttl = 0;  // response cache off
+				memset(resp_cache_entry, 0, sizeof(resp_cache_entry));
+#if J1850_CHANNELS > 1
+				memset(gateway_entry, 0, sizeof(gateway_entry));  // gateway off, first channel
+				gateway_entries = 0;
+				gateway_on = 0;
+				host_channel = 0;
+				j1850_select(0);
+#endif
 				return J1850_RETURN_CODE_OK ;
 		
 			case 'e':  // echo on/off
@@ -325,10 +2132,132 @@ int8_t serial_processing(void)
 					SETBIT(parameter_bits, ECHO);
 				return J1850_RETURN_CODE_OK ;
 			
-			case 'i':  // send ident string
+#if J1850_CHANNELS > 1
+			case 'g':  // gateway between both J1850 channels
+				switch(*(serial_msg_pntr+3))
+				{
+					case 'a':  // add filter entry
+						return gateway_add(serial_msg_pntr+4);
+
+					case 'c':  // clear filter table, all frames pass
+						memset(gateway_entry, 0, sizeof(gateway_entry));
+						gateway_entries = 0;
+						return J1850_RETURN_CODE_OK;
+
+					case '0':  // forwarding off
+					case '1':  // forwarding on
+						gateway_on = *(serial_msg_pntr+3) - '0';
+						return J1850_RETURN_CODE_OK;
+
+					case 's':  // channel for requests and monitoring
+						if( (*(serial_msg_pntr+4) != '0') && (*(serial_msg_pntr+4) != '1') )
+							return J1850_RETURN_CODE_UNKNOWN;
+						host_channel = *(serial_msg_pntr+4) - '0';
+						j1850_select(host_channel);
+						return J1850_RETURN_CODE_OK;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+#endif
+
+			case 'i':  // statistics or ident string
+				switch(*(serial_msg_pntr+3))
+				{
+					case 's':  // statistics as text
+						stats_output(false);
+						return J1850_RETURN_CODE_DATA;
+
+					case 'b':  // statistics binary
+						stats_output(true);
+						return J1850_RETURN_CODE_DATA;
+
+					case 'l':  // response latency histograms
+						latency_output();
+						return J1850_RETURN_CODE_DATA;
+
+					case 'm':  // free SRAM now and minimum ever, frame buffer overruns
+						serial_puts_P(PSTR("SRAM FREE "));
+						var_pntr = (uint8_t *)SP;
+						serial_put_byte2ascii((var_pntr - &_end) >> 8);
+						serial_put_byte2ascii(var_pntr - &_end);
+						serial_puts_P(PSTR(" MIN "));
+						serial_put_byte2ascii(stack_free_min() >> 8);
+						serial_put_byte2ascii(stack_free_min());
+						serial_puts_P(PSTR(" OVERRUNS "));
+						serial_put_byte2ascii(frame_guard_hits >> 8);
+						serial_put_byte2ascii(frame_guard_hits);
+						serial_puts_P(PSTR(" FRAME SLOTS FREE "));
+						j1850_msg_len = 0;  // count free slots
+						for(uint8_t k = 0; k < FRAME_SLOTS; ++k)
+							if( frame_pool[k].len == FRAME_FREE ) ++j1850_msg_len;
+						serial_put_byte2ascii(j1850_msg_len);
+						serial_putc('\r');
+						if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+						return J1850_RETURN_CODE_DATA;
+
+					case 'r':  // reset statistics, latency histograms and measured receive timing
+						cli();
+						memset(&stats, 0, sizeof(stats));
+						sei();
+						memset(latency_hist, 0, sizeof(latency_hist));
+						memset(rx_timing, 0, sizeof(rx_timing));
+						return J1850_RETURN_CODE_OK;
+				}
 				ident();
 				return J1850_RETURN_CODE_OK ;
 
+			case 'j':  // receive thresholds on measured timing per transmitter, off, on or show, glitch filter
+				switch(*(serial_msg_pntr+3))
+				{
+					case '0':
+						j1850_rx_adapt = false;
+						return J1850_RETURN_CODE_OK;
+
+					case '1':
+						j1850_rx_adapt = true;
+						return J1850_RETURN_CODE_OK;
+
+					case 's':
+						rx_timing_output();
+						return J1850_RETURN_CODE_DATA;
+
+					case 'g':  // glitch filter width in us, 00 = off
+						if( (serial_msg_len == 6) && isxdigit(*(serial_msg_pntr+4)) && isxdigit(*(serial_msg_pntr+5)) )
+						{
+							uint8_t us = ascii2byte(serial_msg_pntr+4);
+							if( us > J1850_GLITCH_US_MAX ) return J1850_RETURN_CODE_UNKNOWN;
+							j1850_glitch_ticks = us2cnt(us);
+							return J1850_RETURN_CODE_OK;
+						}
+						break;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
+			case 'k':  // flow control off, RTS/CTS or XON/XOFF
+				switch(*(serial_msg_pntr+3))
+				{
+					case '0':
+						CLEARBIT(parameter_bits, FLOW_HW);
+						CLEARBIT(parameter_bits, FLOW_SW);
+						break;
+
+					case '1':
+						SETBIT(parameter_bits, FLOW_HW);
+						CLEARBIT(parameter_bits, FLOW_SW);
+						break;
+
+					case '2':
+						CLEARBIT(parameter_bits, FLOW_HW);
+						SETBIT(parameter_bits, FLOW_SW);
+						break;
+
+					default:
+						return J1850_RETURN_CODE_UNKNOWN;
+				}
+				cli();
+				CLEARBIT(serial_flow, FLOW_TX_STOP);  // forget XOFF from previous mode
+				sei();
+				return J1850_RETURN_CODE_OK ;
+
 			case 'l': // linefeed on/off (only for data strings)
 				if(*(serial_msg_pntr+3) == '0')
 					CLEARBIT(parameter_bits, LINEFEED);
@@ -343,6 +2272,13 @@ int8_t serial_processing(void)
 					SETBIT(parameter_bits, HEADER);
 				return J1850_RETURN_CODE_OK ;
 
+			case 'q': // pipelined requests on/off
+				if(*(serial_msg_pntr+3) == '0')
+					CLEARBIT(parameter_bits, PIPELINE);
+				else
+					SETBIT(parameter_bits, PIPELINE);
+				return J1850_RETURN_CODE_OK ;
+
 			case 'r': // show response on/off
 				if(*(serial_msg_pntr+3) == '0')
 					CLEARBIT(parameter_bits, RESPONSE);
@@ -355,6 +2291,13 @@ int8_t serial_processing(void)
 					CLEARBIT(parameter_bits, PACKED);
 				return J1850_RETURN_CODE_OK ;
 
+			case 'n': // match responses by service id on/off
+				if(*(serial_msg_pntr+3) == '0')
+					CLEARBIT(parameter_bits, RESP_SID);
+				else
+					SETBIT(parameter_bits, RESP_SID);
+				return J1850_RETURN_CODE_OK ;
+
 			case 'o': // one byte header on/off
 				if(*(serial_msg_pntr+3) == '0')
 					CLEARBIT(parameter_bits, USE_OBH);
@@ -362,9 +2305,13 @@ int8_t serial_processing(void)
 					SETBIT(parameter_bits, USE_OBH);
 				return J1850_RETURN_CODE_OK ;
 
-			case 'p': // send packed data
+			case 'p': // send packed data, or command prompt off/on
 				if(*(serial_msg_pntr+3) == 'd')
 					SETBIT(parameter_bits, PACKED);
+				else if(*(serial_msg_pntr+3) == '0')
+					CLEARBIT(format_bits, PROMPT);
+				else if(*(serial_msg_pntr+3) == '1')
+					SETBIT(format_bits, PROMPT);
 				return J1850_RETURN_CODE_OK ;
 
 			case 'm':  // switch into monitoring mode
@@ -374,6 +2321,28 @@ int8_t serial_processing(void)
 						SETBIT(parameter_bits, MON_RX);  // monitor all
 						SETBIT(parameter_bits, MON_TX);
 						return J1850_RETURN_CODE_DATA; // return, no following parameter
+
+					case 'p':  // raw pulse widths until any char is received, no following parameter
+						pulse_capture();
+						serial_puts_P(stopped);
+						return J1850_RETURN_CODE_DATA;
+
+					case 'c':  // continuous monitoring on/off, no following parameter
+						if(*(serial_msg_pntr+4) == '0')
+						{
+							CLEARBIT(parameter_bits, MON_CONT);
+							if( is_monitoring() )  // also ends a running monitor mode
+							{
+								CLEARBIT(parameter_bits,MON_RX);
+								CLEARBIT(parameter_bits,MON_TX);
+								CLEARBIT(parameter_bits,MON_OBH);
+								serial_puts_P(stopped);
+								return J1850_RETURN_CODE_DATA;
+							}
+						}
+						else
+							SETBIT(parameter_bits, MON_CONT);
+						return J1850_RETURN_CODE_OK;
             
 					case 'i':
 									CLEARBIT(parameter_bits, MON_TX);
@@ -403,13 +2372,24 @@ int8_t serial_processing(void)
 					*var_pntr = ascii2byte(serial_msg_pntr+4);
 					return J1850_RETURN_CODE_DATA;
 				}
-
-			case 's': // commands SH,SR or ST, or SD
+
+			case 's': // commands SH,SR or ST, or SD, or spaces off/on
+				if( serial_msg_len == 4 )
+				{
+					if(*(serial_msg_pntr+3) == '0')
+						CLEARBIT(format_bits, SPACES);
+					else if(*(serial_msg_pntr+3) == '1')
+						SETBIT(format_bits, SPACES);
+					else
+						return J1850_RETURN_CODE_UNKNOWN;
+					return J1850_RETURN_CODE_OK;
+				}
 				if(	isxdigit(*(serial_msg_pntr+4)) && isxdigit(*(serial_msg_pntr+5)) )
 				{  // proceed when next two chars are hex
 					switch(*(serial_msg_pntr+3))
 					{
 						case 'd': 
+							if( j1850_msg_len >= FRAME_SLOT_LEN ) return J1850_RETURN_CODE_DATA_ERROR;  // no room for the CRC
 							while( *serial_msg_pntr )  // check all chars are valid hex chars
 							{
 								//serial_log(*serial_msg_pntr);
@@ -427,9 +2407,13 @@ int8_t serial_processing(void)
 							
 							// generate CRC for J1850 message and store, use 1 or 3 byte header
 							j1850_msg_buf[j1850_msg_len] = j1850_crc( j1850_msg_buf,j1850_msg_len );  
+							frame_guard_check(frame_request);
 						  
 							// send J1850 message and save return code, use 1 or 3 byte header
-							return j1850_send_msg(j1850_msg_buf, j1850_msg_len +1, CHECKBIT(parameter_bits, MSG_LEN));
+							return_code = j1850_send_msg(j1850_msg_buf, j1850_msg_len +1, CHECKBIT(parameter_bits, MSG_LEN));
+							if( (return_code == J1850_RETURN_CODE_OK) && is_monitoring() && CHECKBIT(parameter_bits, MON_CONT) )
+								monitor_output(j1850_msg_buf, j1850_msg_len +1, MON_TAG_TX);  // show own frame inline
+							return return_code;
 							 
 						case 'h':  // set header bytes
 							if(
@@ -494,6 +2478,108 @@ int8_t serial_processing(void)
 				} // end if char 4 and 5 isxdigit
 				return J1850_RETURN_CODE_UNKNOWN;
 
+			case 't':  // trigger capture, arm, dump, status or clear
+				switch(*(serial_msg_pntr+3))
+				{
+					case 'a':
+						return capture_arm(serial_msg_pntr+4);
+
+					case 'd':
+						return capture_dump();
+
+					case 's':  // state and number of frames kept
+						serial_puts_P(capture_state_txt[capture_state]);
+						serial_put_byte2ascii(capture_count);
+						serial_putc('\r');
+						if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+						return J1850_RETURN_CODE_DATA;
+
+					case 'c':
+						capture_clear();
+						return J1850_RETURN_CODE_OK;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
+			case 'u':  // ECU emulation, add responder entry or clear table
+				if(*(serial_msg_pntr+3) == 'a')
+					return ecu_add(serial_msg_pntr+4);
+				if( (*(serial_msg_pntr+3) == 'c') && (serial_msg_len == 4) )
+				{
+					memset(ecu_entry, 0, sizeof(ecu_entry));
+					ecu_entries = 0;
+					return J1850_RETURN_CODE_OK;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
+			case 'v':  // latest value cache by frame header
+				switch(*(serial_msg_pntr+3))
+				{
+					case 'a':  // register header
+						return cache_add(serial_msg_pntr+4);
+
+					case 'c':  // clear all headers
+						cache_entries = 0;
+						return J1850_RETURN_CODE_OK;
+
+					case 'g':  // get age and data of one header
+					{
+						cache_entry_t *e = cache_find(serial_msg_pntr+4);
+						if( !e ) return J1850_RETURN_CODE_UNKNOWN;
+						if( e->len == CACHE_NO_DATA ) return J1850_RETURN_CODE_NO_DATA;
+						cache_output(e, false, true);
+						return J1850_RETURN_CODE_DATA;
+					}
+
+					case 'l':  // list headers with age
+					case 'd':  // dump headers with age and data
+						for(uint8_t k = 0; k < cache_entries; ++k)
+							cache_output(&cache_entry[k], true, *(serial_msg_pntr+3) == 'd');
+						return J1850_RETURN_CODE_DATA;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
+			case 'w':  // configuration in EEPROM, save, load or clear
+				switch(*(serial_msg_pntr+3))
+				{
+					case 's':
+						config_save();
+						return J1850_RETURN_CODE_OK;
+
+					case 'l':
+						return config_load(false) ? J1850_RETURN_CODE_OK : J1850_RETURN_CODE_NO_DATA;
+
+					case 'c':  // boot with compiled defaults
+						eeprom_update_byte(&config_eeprom.version, 0xFF);
+						return J1850_RETURN_CODE_OK;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
+			case 'x':  // signal extraction, add, clear, stream off/on or list
+				switch(*(serial_msg_pntr+3))
+				{
+					case 'a':
+						return signal_add(serial_msg_pntr+4);
+
+					case 'c':
+						signal_entries = 0;
+						return J1850_RETURN_CODE_OK;
+
+					case '0':
+						signal_stream = false;
+						return J1850_RETURN_CODE_OK;
+
+					case '1':  // current values go out with the next frame
+						for(uint8_t k = 0; k < signal_entries; ++k)
+							signal_entry[k].state &= ~SIGNAL_SENT;
+						signal_stream = true;
+						return J1850_RETURN_CODE_OK;
+
+					case 'l':
+						signal_list();
+						return J1850_RETURN_CODE_DATA;
+				}
+				return J1850_RETURN_CODE_UNKNOWN;
+
 			case 'z':  // reset all and restart device
 				wdt_enable(WDTO_15MS);	// enable watdog timeout 15ms
 				for(;;);	// wait for watchdog reset
@@ -519,7 +2605,6 @@ int8_t serial_processing(void)
 		}
 		serial_msg_pntr = (char *)&serial_msg_buf[0];  // reset pointer
 	
-		uint8_t j1850_msg_buf[12];  // J1850 message to be send
 		uint8_t *j1850_msg_pntr = &j1850_msg_buf[0];  //  msg pointer
 		uint8_t cnt;  // byte counter
 		
@@ -547,28 +2632,73 @@ int8_t serial_processing(void)
 			*(++j1850_msg_pntr) = j1850_crc( j1850_msg_buf,serial_msg_len+3 );  // use three header byte
       
 		// send J1850 message and save return code, use 1 or 3 byte header
-		uint8_t return_code;
 		if(CHECKBIT(parameter_bits, USE_OBH)){
-			return_code = j1850_send_msg(j1850_msg_buf, serial_msg_len+2, CHECKBIT(parameter_bits, MSG_LEN));
+			cnt = serial_msg_len+2;
 		}else{
-			return_code = j1850_send_msg(j1850_msg_buf, serial_msg_len+4, CHECKBIT(parameter_bits, MSG_LEN));
+			cnt = serial_msg_len+4;
 		}
+		uint8_t req_sid = j1850_msg_buf[cnt-serial_msg_len-1];  // first data byte is the service id
+
+		// answer a repeated request from the response cache while it is fresh,
+		// else keep the request, the response is received into the same buffer
+		uint8_t req_key[RESP_CACHE_REQ_MAX];
+		uint8_t req_len = cnt - 1;  // without CRC
+		if( resp_cache_ttl && CHECKBIT(parameter_bits, RESPONSE) && !CHECKBIT(parameter_bits, PIPELINE) )
+		{
+			resp_cache_entry_t *e = resp_cache_find(j1850_msg_buf, req_len, auto_recv_addr);
+			if( e )
+			{
+				memcpy(j1850_msg_buf, e->resp, e->resp_len);
+				return response_output(j1850_msg_buf, e->resp_len, MON_TAG_NONE);
+			}
+			memcpy(req_key, j1850_msg_buf, req_len);
+		}
+
+		// one request per receive address in flight, wait for a free slot
+		while( pipe_pending && pipeline_busy(auto_recv_addr) ) bus_poll();
+
+		// show own frame inline before sending, nothing may delay the receive after our EOF
+		if( is_monitoring() && CHECKBIT(parameter_bits, MON_CONT) )
+			monitor_output(j1850_msg_buf, cnt, MON_TAG_TX);  // Tx ring buffer keeps the bus receive going
+
+		uint8_t recv_nbytes = J1850_RETURN_CODE_NO_DATA | 0x80;  // first receive, done by the driver at our EOF
+		if( CHECKBIT(parameter_bits, RESPONSE) )
+			return_code = j1850_send_recv(j1850_msg_buf, cnt, CHECKBIT(parameter_bits, MSG_LEN), &recv_nbytes);
+		else
+			return_code = j1850_send_msg(j1850_msg_buf, cnt, CHECKBIT(parameter_bits, MSG_LEN));
+		uint16_t eof_time = j1850_eof_time;  // end of our frame, for response latency
+		frame_guard_check(frame_request);
 		
-		
-		
+		// do not wait for the response of a pipelined request
+		if( (return_code == J1850_RETURN_CODE_OK) && CHECKBIT(parameter_bits, RESPONSE) && CHECKBIT(parameter_bits, PIPELINE) )
+		{
+			return_code = pipeline_add(auto_recv_addr, req_sid, eof_time);
+			if( !(recv_nbytes & 0x80) )  // a fast responder already answered
+			{
+				frame_request = capture_take(frame_request, recv_nbytes);
+				frame_dispatch(j1850_msg_buf, recv_nbytes);
+			}
+			return return_code;
+		}
+
 		// skip receive in case of transmit error or RESPONSE disabled
 		if( (return_code == J1850_RETURN_CODE_OK) && CHECKBIT(parameter_bits, RESPONSE) )
 		{
 			uint16_t time_count = 0;		
+			uint8_t resp_type = RESP_OTHER;  // response classification
+			bool timed = false;  // response latency recorded
 
-			do
+			// first frame was received by j1850_send_recv(), then receive J1850 respond,
+			// into a fresh slot when the trigger capture took the last frame
+			for(cnt = recv_nbytes; ; cnt = j1850_recv_msg(j1850_msg_buf = frame_data(frame_request), CHECKBIT(parameter_bits, MSG_LEN)))
 			{
 				/*
 					Run this loop until we received a valid response frame, or response timed out,
 					or the bus was idle for 100ms or an bus error occured.
 				*/
 			
-				cnt = j1850_recv_msg(j1850_msg_buf, CHECKBIT(parameter_bits, MSG_LEN));  // receive J1850 respond
+				frame_guard_check(frame_request);
+				pipeline_tick();  // age other requests still in flight
 
 				/*
 					the j1850_recv_msg() has a timeout of 100us
@@ -593,11 +2723,38 @@ int8_t serial_processing(void)
 						return cnt & 0x7F;  // return "receive message" error code
 				}
 
-				j1850_msg_pntr = &j1850_msg_buf[0];
+				if( cnt & 0x80 ) continue;  // nothing received
+				frame_request = capture_take(frame_request, cnt);
+
+				if( auto_recv_addr == j1850_msg_buf[1] )
+				{
+					resp_type = response_type(j1850_msg_buf, cnt, req_sid);
+					if( !timed && ((resp_type != RESP_OTHER) || !CHECKBIT(parameter_bits, RESP_SID)) )
+					{  // first answer, pending or final
+						latency_add(auto_recv_addr, j1850_sof_time - eof_time);
+						timed = true;
+					}
+					if( resp_type == RESP_PENDING )
+					{
+						/*
+							Request correctly received, response pending.
+							The ECU needs more time, restart the response timeout.
+						*/
+						time_count = 0;
+						if( is_monitoring() && CHECKBIT(parameter_bits, MON_CONT) )
+							monitor_output(j1850_msg_buf, cnt, MON_TAG_RESP);
+						continue;
+					}
+					// without SID matching any frame from the receive address is the response
+					if( (resp_type != RESP_OTHER) || !CHECKBIT(parameter_bits, RESP_SID) )
+						break;
+				}
+
+				// keep other bus traffic in the monitor stream and pipelined responses
+				frame_dispatch(j1850_msg_buf, cnt);
+			}
 
-			} while( 
-			auto_recv_addr != *(j1850_msg_pntr+1) 
-			);	
+			j1850_msg_pntr = &j1850_msg_buf[0];
 
 			// check respond CRC
 			if( *(j1850_msg_pntr+(cnt-1)) != j1850_crc(j1850_msg_buf, cnt-1) )
@@ -626,44 +2783,17 @@ int8_t serial_processing(void)
 				else
 					return J1850_RETURN_CODE_NO_DATA;
 			}
-			
-			if( !CHECKBIT(parameter_bits, HEADER) )
-			{ 
-				if(CHECKBIT(parameter_bits, USE_OBH) )  // check if one byte header frames are used
-				{
-					cnt -= 2;  // discard 1st header byte and CRC
-					j1850_msg_pntr += 1;  // skip header byte
-				}
-				else
-				{
-					cnt -= 4;  // discard 3 header bytes and CRC
-					j1850_msg_pntr += 3;  // skip 3 header bytes
-				}
-			}
-			
-			
-			
-			if(CHECKBIT(parameter_bits, PACKED))
-				serial_putc(cnt);  // length byte
-			
-			// output response data
-			for(;cnt > 0; --cnt)
-			{
-				if(CHECKBIT(parameter_bits, PACKED))
-					serial_putc(*j1850_msg_pntr++);  // length byte
-				else
-				{
-					serial_put_byte2ascii(*j1850_msg_pntr++);
-					serial_putc(' ');
-				}
-			}
-			
-			if(!CHECKBIT(parameter_bits, PACKED))
-			{// formated output with CR and optional LF
-				serial_putc('\r');
-				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-			}
-			return J1850_RETURN_CODE_DATA;  // surpress any other output
+
+			if( resp_cache_ttl && (resp_type == RESP_POSITIVE) )
+				resp_cache_store(req_key, req_len, auto_recv_addr, j1850_msg_buf, cnt);
+
+			// negative responses get tagged when matching by SID
+			if( (resp_type == RESP_NEGATIVE) && CHECKBIT(parameter_bits, RESP_SID) )
+				resp_type = MON_TAG_NEG;
+			else
+				resp_type = MON_TAG_NONE;
+
+			return response_output(j1850_msg_buf, cnt, resp_type);
 
 		}  // end if J1850 OK && RESPONSE
 		else  // transmit error or show RESPONSE OFF, return error code
@@ -688,12 +2818,40 @@ int8_t serial_processing(void)
 */
 int16_t serial_putc(int8_t data)
 {
-	// wait for USART to become available
-		while ( (UCSRA & _BV(UDRE)) != _BV(UDRE));
-		UDR = data; 									// send character
-		return 0;
+	uint8_t head = (serial_tx_head + 1) & (SERIAL_TX_RING_SIZE - 1);
+
+	// wait for room in Tx ring buffer, re-check host flow control meanwhile
+	while( head == serial_tx_tail ) UCSRB |= _BV(UDRIE);
+
+	serial_tx_ring[serial_tx_head] = data;
+	serial_tx_head = head;
+	UCSRB |= _BV(UDRIE);  // start transmitter
+	return 0;
 }; //end usart_putc
 
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Queue one byte for the USART without waiting
+**
+** Parameters: data byte
+**
+** Returns: false when the Tx ring buffer is full, byte dropped
+**
+**---------------------------------------------------------------------------
+*/
+bool serial_try_putc(uint8_t data)
+{
+	uint8_t head = (serial_tx_head + 1) & (SERIAL_TX_RING_SIZE - 1);
+
+	if( head == serial_tx_tail ) return false;
+
+	serial_tx_ring[serial_tx_head] = data;
+	serial_tx_head = head;
+	UCSRB |= _BV(UDRIE);  // start transmitter
+	return true;
+}
+
 void serial_log(int8_t c){
 	serial_putc(c);
 	serial_putc('\r');
@@ -713,9 +2871,65 @@ void serial_log(int8_t c){
 */
 void serial_put_byte2ascii(uint8_t val)
 {
-	uint8_t ascii1=val;
-	serial_putc( ((ascii1>>4) < 10) ? (ascii1>>4) + 48 : (ascii1>>4) + 55 );  // upper nibble
-	serial_putc( ((val&0x0f) < 10) ? (val&0x0f) + 48 : (val&0x0f) + 55 );  // lower nibble
+	serial_putc( pgm_read_byte(&hex_digit[val >> 4]) );  // upper nibble
+	serial_putc( pgm_read_byte(&hex_digit[val & 0x0f]) );  // lower nibble
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Send frame bytes as hex, separated by spaces unless AT S0,
+**           followed by CR and optional LF. When the Tx ring buffer has
+**           room for the whole line it is rendered there in one pass and
+**           the transmitter started once, otherwise char by char.
+**
+** Parameters: Pointer to frame bytes, number of bytes
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void serial_put_frame2ascii(uint8_t *data, int8_t nbytes)
+{
+	uint8_t step = CHECKBIT(format_bits, SPACES) ? 3 : 2;  // chars per byte
+	uint8_t eol = CHECKBIT(parameter_bits, LINEFEED) ? 2 : 1;
+	uint16_t need = (nbytes > 0 ? nbytes * step : 0) + eol;
+
+	if( need > ((serial_tx_tail - serial_tx_head - 1) & (SERIAL_TX_RING_SIZE - 1)) )
+	{  // no room for the whole line, wait for the transmitter char by char
+		for(;nbytes > 0; nbytes--)
+		{
+			serial_put_byte2ascii(*data++);
+			if(step == 3) serial_putc(' ');
+		}
+		serial_putc('\r');
+		if(eol == 2) serial_putc('\n');
+		return;
+	}
+
+	uint8_t head = serial_tx_head;  // only the main loop moves the head
+	for(;nbytes > 0; nbytes--)
+	{
+		uint8_t val = *data++;
+		serial_tx_ring[head] = pgm_read_byte(&hex_digit[val >> 4]);
+		head = (head + 1) & (SERIAL_TX_RING_SIZE - 1);
+		serial_tx_ring[head] = pgm_read_byte(&hex_digit[val & 0x0f]);
+		head = (head + 1) & (SERIAL_TX_RING_SIZE - 1);
+		if(step == 3)
+		{
+			serial_tx_ring[head] = ' ';
+			head = (head + 1) & (SERIAL_TX_RING_SIZE - 1);
+		}
+	}
+	serial_tx_ring[head] = '\r';
+	head = (head + 1) & (SERIAL_TX_RING_SIZE - 1);
+	if(eol == 2)
+	{
+		serial_tx_ring[head] = '\n';
+		head = (head + 1) & (SERIAL_TX_RING_SIZE - 1);
+	}
+	serial_tx_head = head;  // publish the line
+	UCSRB |= _BV(UDRIE);  // start transmitter
 }
 
 
@@ -738,7 +2952,9 @@ void serial_puts_P(const char *s)
 /*
 **---------------------------------------------------------------------------
 **
-** Abstract: USART Receive Interrupt
+** Abstract: Throttle the host, our Rx ring buffer reached the high watermark.
+**           Deasserts RTS and queues XOFF ahead of pending output,
+**           depending on the flow control mode.
 **
 ** Parameters: none
 **
@@ -746,98 +2962,243 @@ void serial_puts_P(const char *s)
 **
 **---------------------------------------------------------------------------
 */
-//SIGNAL(SIG_UART_RECV)
-/* USART, Rx Complete */		
-ISR(_VECTOR(11))
+void serial_flow_stop(void)
 {
-	uint8_t *hlp_pntr = &serial_msg_buf[sizeof(serial_msg_buf)-1];  // get end of serial buffer
-
-	// check for buffer end, prevent buffer overflow
-	if ( serial_msg_pntr > hlp_pntr )
+	SETBIT(serial_flow, FLOW_RX_STOP);
+	if( CHECKBIT(parameter_bits, FLOW_HW) )
+		FLOW_PORT_OUT |= _BV(FLOW_PIN_RTS);  // deassert RTS
+	if( CHECKBIT(parameter_bits, FLOW_SW) )
 	{
-		serial_msg_pntr = &serial_msg_buf[sizeof(serial_msg_buf)-1];
+		serial_flow_char = XOFF;
+		UCSRB |= _BV(UDRIE);  // send XOFF ahead of any pending output
 	}
-	
-	uint8_t in_char = UDR;  // get received char
+}
 
-	// end monitor modes on any received char
-	if( CHECKBIT(parameter_bits,MON_RX) ||
-      CHECKBIT(parameter_bits,MON_TX) ||
-      CHECKBIT(parameter_bits,MON_OBH)
-    )
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Release the host, our Rx ring buffer drained below the low watermark
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void serial_flow_go(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	CLEARBIT(serial_flow, FLOW_RX_STOP);
+	FLOW_PORT_OUT &=~ _BV(FLOW_PIN_RTS);  // assert RTS
+	if( CHECKBIT(parameter_bits, FLOW_SW) )
 	{
-		CLEARBIT(parameter_bits,MON_RX);
-		CLEARBIT(parameter_bits,MON_TX);
-		CLEARBIT(parameter_bits,MON_OBH);
-		serial_puts_P(stopped);
-		if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-		print_prompt();  // command prompt to terminal
+		serial_flow_char = XON;
+		UCSRB |= _BV(UDRIE);  // send XON ahead of any pending output
 	}
-	else  // no active monitor mode
-	{
-		if( CHECKBIT(parameter_bits,ECHO) )  // return char when echo is on
-			serial_putc(in_char);		
+	SREG = sreg;
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Collect one received char into the command line and process
+**           the command on CR
+**
+** Parameters: received char
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+static void serial_rx_char(uint8_t in_char)
+{
+	if( CHECKBIT(parameter_bits,ECHO) )  // return char when echo is on
+		serial_putc(in_char);		
 
-		// check for terminating char
-		if(in_char == 0x0D)
+	// check for terminating char
+	if(in_char == 0x0D)
+	{
+		//if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');    
+		*(serial_msg_pntr) = 0x00;	// terminate received message
+		if( serial_msg_overrun )  // command was truncated, never execute it
 		{
-			//if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');    
-			*(serial_msg_pntr) = 0x00;	// terminate received message
-			switch ( serial_processing() )  // process serial message
-			{
-				case J1850_RETURN_CODE_OK:  // success
-					serial_puts_P(PSTR("OK\r"));
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal
-					break;
-				case J1850_RETURN_CODE_BUS_BUSY:  // bus was busy
-					serial_puts_P(bus_busy_txt);
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal
-					break;
-				case J1850_RETURN_CODE_BUS_ERROR:  // bus error detected
-					serial_puts_P(bus_error_txt);
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal
-					break;
-				case J1850_RETURN_CODE_DATA_ERROR:  // data error detected
-					serial_puts_P(data_error_txt);
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal						
-					break;
-				case J1850_RETURN_CODE_NO_DATA:  // no data response (response timeout)
-					serial_puts_P(no_data_txt);
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal	
+			serial_msg_overrun = false;
+			serial_puts_P(PSTR("?\r"));
+			if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+		}
+		else switch ( serial_processing() )  // process serial message
+		{
+			case J1850_RETURN_CODE_OK:  // success
+				serial_puts_P(PSTR("OK\r"));
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal
+				break;
+			case J1850_RETURN_CODE_BUS_BUSY:  // bus was busy
+				serial_puts_P(bus_busy_txt);
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal
+				break;
+			case J1850_RETURN_CODE_BUS_ERROR:  // bus error detected
+				serial_puts_P(bus_error_txt);
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal
+				break;
+			case J1850_RETURN_CODE_DATA_ERROR:  // data error detected
+				serial_puts_P(data_error_txt);
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal						
+				break;
+			case J1850_RETURN_CODE_NO_DATA:  // no data response (response timeout)
+				serial_puts_P(no_data_txt);
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal	
+				break;
+			case J1850_RETURN_CODE_DATA:     // data response
+				if( 
+					CHECKBIT(parameter_bits,MON_RX) ||
+					CHECKBIT(parameter_bits,MON_TX) ||
+					CHECKBIT(parameter_bits,MON_OBH)
+				){
 					break;
-				case J1850_RETURN_CODE_DATA:     // data response
-					if( 
-						CHECKBIT(parameter_bits,MON_RX) ||
-						CHECKBIT(parameter_bits,MON_TX) ||
-						CHECKBIT(parameter_bits,MON_OBH)
-					){
-						break;
-					}
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					print_prompt();  // command prompt to terminal
-					break;			
-				default: // unknown error
-					serial_puts_P(PSTR("?\r"));
-					if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
-					//print_prompt();  // command prompt to terminal	
-			}
-			serial_msg_pntr = &serial_msg_buf[0];  // start new message
+				}
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				print_prompt();  // command prompt to terminal
+				break;			
+			default: // unknown error
+				serial_puts_P(PSTR("?\r"));
+				if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
+				//print_prompt();  // command prompt to terminal	
 		}
-	
-		// received char was no termination
-		if(isalnum((int16_t)in_char))
-		{  // check for valid alphanumeric char and save in buffer
+		serial_msg_pntr = &serial_msg_buf[0];  // start new message
+	}
+
+	// received char was no termination
+	if(isalnum((int16_t)in_char))
+	{  // check for valid alphanumeric char and save in buffer
+		if( serial_msg_pntr < &serial_msg_buf[sizeof(serial_msg_buf)-1] )  // keep room for terminator
+		{
 			*serial_msg_pntr = in_char;
 			++serial_msg_pntr;	
 		}
-  }
+		else
+			serial_msg_overrun = true;
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: Process all chars waiting in the Rx ring buffer
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+void serial_poll(void)
+{
+	if( serial_tx_head != serial_tx_tail ) UCSRB |= _BV(UDRIE);  // host may have raised CTS again
+
+	while( serial_rx_head != serial_rx_tail )
+	{
+		uint8_t in_char = serial_rx_ring[serial_rx_tail];
+		serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_RING_SIZE - 1);
+
+		// release host when enough room is available again
+		if( CHECKBIT(serial_flow, FLOW_RX_STOP) &&
+			((serial_rx_head - serial_rx_tail) & (SERIAL_RX_RING_SIZE - 1)) <= SERIAL_RX_LOW_WATER )
+			serial_flow_go();
+
+		serial_rx_char(in_char);
+	}
+}
+
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: USART Receive Interrupt
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+//SIGNAL(SIG_UART_RECV)
+/* USART, Rx Complete */		
+ISR(VECTOR_USART_RXC)
+{
+	if( UCSRA & _BV(DOR) ) ++stats.uart_overruns;  // char lost in USART, read flag before UDR
+
+	uint8_t in_char = UDR;  // get received char
+
+	if( CHECKBIT(parameter_bits, FLOW_SW) )
+	{  // XON/XOFF control our output and are never stored
+		if(in_char == XOFF)
+		{
+			SETBIT(serial_flow, FLOW_TX_STOP);
+			return;
+		}
+		if(in_char == XON)
+		{
+			CLEARBIT(serial_flow, FLOW_TX_STOP);
+			UCSRB |= _BV(UDRIE);  // resume output
+			return;
+		}
+	}
+
+	uint8_t head = (serial_rx_head + 1) & (SERIAL_RX_RING_SIZE - 1);
+	if( head != serial_rx_tail )  // prevent buffer overflow
+	{
+		serial_rx_ring[serial_rx_head] = in_char;
+		serial_rx_head = head;
+	}
+	else
+		++stats.uart_overruns;
+
+	// throttle host at high watermark
+	if( !CHECKBIT(serial_flow, FLOW_RX_STOP) &&
+		((serial_rx_head - serial_rx_tail) & (SERIAL_RX_RING_SIZE - 1)) >= SERIAL_RX_HIGH_WATER )
+		serial_flow_stop();
 };// end of UART receive interrupt
 
+/*
+**---------------------------------------------------------------------------
+**
+** Abstract: USART Data Register Empty Interrupt, sends pending XON/XOFF
+**           first, then the Tx ring buffer as long as the host accepts data
+**
+** Parameters: none
+**
+** Returns: none
+**
+**---------------------------------------------------------------------------
+*/
+/* USART, Data Register Empty */
+ISR(VECTOR_USART_UDRE)
+{
+	if( serial_flow_char )
+	{
+		UDR = serial_flow_char;
+		serial_flow_char = 0;
+		return;
+	}
+
+	if( (serial_tx_head == serial_tx_tail) ||
+		(CHECKBIT(parameter_bits, FLOW_HW) && bit_is_set(FLOW_PORT_IN, FLOW_PIN_CTS)) ||
+		(CHECKBIT(parameter_bits, FLOW_SW) && CHECKBIT(serial_flow, FLOW_TX_STOP))
+	  )
+	{
+		UCSRB &=~ _BV(UDRIE);  // nothing to send or host not ready, re-enabled by serial_putc()
+		return;
+	}
+
+	UDR = serial_tx_ring[serial_tx_tail];  // send character
+	serial_tx_tail = (serial_tx_tail + 1) & (SERIAL_TX_RING_SIZE - 1);
+};// end of UART data register empty interrupt
+
 /*
 **---------------------------------------------------------------------------
 **
@@ -854,6 +3215,7 @@ ISR(_VECTOR(11))
 */
 void print_prompt(void)
 {
+	if( !CHECKBIT(format_bits, PROMPT) ) return;  // AT P0, lines end with the status text
 	if(CHECKBIT(parameter_bits, LINEFEED)) serial_putc('\n');
 	serial_puts_P(PSTR("\r>"));	// send new command prompt
 }
@@ -21,20 +21,74 @@
 **									+ added stopped text for ATMx AT commands 
 **  10/07/21    v1.09   Remi S      + added parameter bit mask for message length checking or not
 **                                  * changed SERIAL_MSG_BUF_SIZE to 128 bytes
+**  19/10/26    v1.10   Remi S      + added serial receive ring buffer with RTS/CTS and XON/XOFF flow control
+**                                  + added 230.4k and 460.8k baud rates using USART double speed
+**                                  + added serial transmit ring buffer and continuous monitor mode
+**                                  + added response classification by service id
+**                                  + added pipelined request slots
+**                                  + added ECU emulation responder table
+**                                  + added trigger capture buffer
+**                                  + added raw pulse capture stream codes
+**                                  + added statistics output
+**                                  + added response latency histograms
+**                                  + added SRAM high water mark and frame buffer guard bytes
+**                                  + added EEPROM configuration layout
+**                                  * baud rate values rounded, error checked against MCU_XTAL
+**                                  + added gateway filter table for the second J1850 channel
+**                                  + added latest value cache by frame header
+**                                  * frame buffers moved into one pool of slots, trigger capture keeps slot numbers
+**                                  + added signal extraction table and changed value stream
+**                                  * serial buffers, pipeline slots and capture depth scaled by MCU_SRAM_SCALE
+**                                  + added glitch counters to the statistics
+**                                  + added output format bits for spaces and prompt, hex digit table
+**                                  + added response cache for repeated requests with a time to live
+**                                  * lookup tables and capture depth halved on 1K SRAM parts, data and bss did not fit
+**                                  + added SRAM budget of the tables, checked at compile time
+**                                  + latest value cache ages saturate at CACHE_AGE_MAX
+**                                  * frame slot length in front of the data, 4 guard bytes right behind it, one latency histogram and gateway entry on 1K SRAM parts
 **
 **************************************************************************/
 #ifndef __MAIN_H__
 #define __MAIN_H__
 
-// Set default RS232 baud rate
+// Set default RS232 baud rate, may be given by the makefile for other crystals
+#ifndef BAUD_RATE
 #define BAUD_RATE    115200
+#endif
+
+// Buffers below grow by MCU_SRAM_SCALE, 1 on the 1K ATmega8, 2 on 2K parts (see mcu.h)
 
 // J1850 message (max 12 byte - 3 byte header - 1 CRC byte) x 2
 // because of 2 ASCII chars/byte + 1 terminator
-// or 10 bytes for AT command
-#define SERIAL_MSG_BUF_SIZE	128
+// or 10 bytes for AT command, at most 256 for the 8 bit command length
+#define SERIAL_MSG_BUF_SIZE	(128 * MCU_SRAM_SCALE)
+
+// USART receive ring buffer filled by the Rx interrupt, must be a power of 2
+// the host gets throttled above the high and released below the low watermark
+#define SERIAL_RX_RING_SIZE		(32 * MCU_SRAM_SCALE)
+#define SERIAL_RX_HIGH_WATER	(SERIAL_RX_RING_SIZE / 2)
+#define SERIAL_RX_LOW_WATER		4
+
+// USART transmit ring buffer drained by the UDRE interrupt, must be a power of 2
+#define SERIAL_TX_RING_SIZE		(64 * MCU_SRAM_SCALE)
+
+/*** CONFIG START ***/
+
+#define FLOW_PORT_OUT		PORTD	// RTS output port
+#define FLOW_DIR_OUT		DDRD	// RTS direction register
+#define FLOW_PIN_RTS		4			// RTS output pin, low = host may send
+
+#define FLOW_PORT_IN		PIND	// CTS input port
+#define FLOW_PULLUP_IN	PORTD	// CTS pull-up register
+#define FLOW_DIR_IN			DDRD	// CTS direction register
+#define FLOW_PIN_CTS		5			// CTS input pin, low = host is ready to receive
+
+/*** CONFIG END ***/
+
+#define XON		0x11	// software flow control resume char
+#define XOFF	0x13	// software flow control stop char
 
-const char ident_txt[]    PROGMEM = "AVR-J1850 VPW v1.09\r" __DATE__" / "__TIME__"\r\r";
+const char ident_txt[]    PROGMEM = "AVR-J1850 VPW v1.10\r" __DATE__" / "__TIME__"\r\r";
 //const char ident_txt[]    PROGMEM = "ELM322 v2.0\r\n\r\n";
 
 const char bus_busy_txt[]   PROGMEM = "BUSBUSY\r";
@@ -60,33 +114,368 @@ const char stopped[]    PROGMEM = "STOPPED\r";
 #define MON_OBH		0x0100 // bit 8 : monitor one byte header
 #define USE_OBH		0x0200 // bit 9 : use one byte header in Tx message
 #define MSG_LEN		0x0400 // bit 10 : check for message length before sending on the bus
+#define FLOW_HW		0x0800 // bit 11 : RTS/CTS hardware flow control
+#define FLOW_SW		0x1000 // bit 12 : XON/XOFF software flow control
+#define MON_CONT	0x2000 // bit 13 : keep monitoring while commands are executed
+#define RESP_SID	0x4000 // bit 14 : match responses by service id
+#define PIPELINE	0x8000 // bit 15 : pipelined requests, do not wait for responses
+
+// define output format bit mask constants, parameter_bits has no bit left
+#define SPACES		0x01 // bit 0 : space between hex bytes on/off
+#define PROMPT		0x02 // bit 1 : command prompt on/off
+
+#define is_monitoring() (CHECKBIT(parameter_bits, MON_RX) || CHECKBIT(parameter_bits, MON_TX) || CHECKBIT(parameter_bits, MON_OBH))
+
+// define monitor output tags for our own traffic in continuous monitor mode
+#define MON_TAG_NONE	0x00 // bus traffic, no tag
+#define MON_TAG_TX		0xF1 // frame sent by us, "T " in formatted output
+#define MON_TAG_RESP	0xF2 // response to a frame sent by us, "R " in formatted output
+#define MON_TAG_NEG		0xF3 // negative response to a frame sent by us, "N " in formatted output
+#define MON_TAG_PIPE	0xF4 // response to a pipelined request followed by its tag, "#tt " in formatted output
+#define MON_TAG_TRIG	0xF5 // trigger frame in a capture dump, "* " in formatted output
+#define MON_TAG_SIG		0xF6 // changed signal value followed by the signal number, "S" in formatted output
+
+const char mon_tag_txt[]  PROGMEM = " TRN#*S";  // formatted output tag chars, indexed by tag low nibble
+
+const char hex_digit[]  PROGMEM = "0123456789ABCDEF";  // ASCII hex digit by nibble
+
+// define response classification
+#define RESP_OTHER		0 // not a response to our request
+#define RESP_POSITIVE	1 // service id + 0x40
+#define RESP_NEGATIVE	2 // 0x7F, service id, negative response code
+#define RESP_PENDING	3 // negative response code 0x78
+
+#define NRC_RESPONSE_PENDING	0x78 // request correctly received, response pending
+
+// pipelined requests in flight, one per receive address
+#define PIPELINE_SLOTS	(4 * MCU_SRAM_SCALE)
+
+typedef struct
+{
+	uint8_t tag;  // request tag, 0 = slot free
+	uint8_t addr;  // receive address of the response
+	uint8_t sid;  // service id of the request
+	uint16_t time_count;  // receive calls since request or last response pending
+	uint16_t eof_time;  // time stamp at the end of the request
+	bool timed;  // response latency recorded
+} pipe_slot_t;
+
+pipe_slot_t pipe_slot[PIPELINE_SLOTS];
+uint8_t pipe_tag;  // last request tag
+uint8_t pipe_pending;  // number of requests in flight
+
+// compared leading frame bytes, header and service id, see frame_match()
+#define FRAME_MATCH_LEN	4
+
+// ECU emulation responder table
+#define ECU_ENTRIES		(2 * MCU_SRAM_SCALE)  // number of responder entries
+#define ECU_RESP_MAX	8  // response template bytes, header included, CRC added on send
+
+typedef struct
+{
+	uint8_t match[FRAME_MATCH_LEN];  // request bytes to match
+	uint8_t mask[FRAME_MATCH_LEN];  // bits to compare, 0 = don't care
+	uint8_t resp[ECU_RESP_MAX];  // response template
+	uint8_t resp_len;  // template length, 0 = entry free
+	uint8_t echo;  // request bytes after the service id copied behind the response service id
+} ecu_entry_t;
+
+ecu_entry_t ecu_entry[ECU_ENTRIES];
+uint8_t ecu_entries;  // number of entries in use
+
+#if J1850_CHANNELS > 1
+// gateway between both J1850 channels, frames forwarded through a filter table
+#define GATEWAY_ENTRIES	((MCU_SRAM_SCALE > 1) ? 4 : 1)  // number of filter entries, no entry = forward all
+#define GATEWAY_A_TO_B	0x01  // forward matching frames received on the first channel
+#define GATEWAY_B_TO_A	0x02  // forward matching frames received on the second channel
+
+typedef struct
+{
+	uint8_t match[FRAME_MATCH_LEN];  // frame bytes to match
+	uint8_t mask[FRAME_MATCH_LEN];  // bits to compare, 0 = don't care
+	uint8_t dir;  // forwarding directions, 0 = entry free
+} gateway_entry_t;
+
+gateway_entry_t gateway_entry[GATEWAY_ENTRIES];
+uint8_t gateway_entries;  // number of entries in use
+uint8_t gateway_on;  // forwarding active, background receive listens on both channels
+uint8_t host_channel;  // channel of requests and monitoring, selected again after each background receive
+#endif
+
+// latest value cache, last data of frames with a registered header
+#define CACHE_ENTRIES	(4 * MCU_SRAM_SCALE)  // number of headers
+#define CACHE_DATA_MAX	8  // data bytes kept after the 3 header bytes, CRC not kept
+#define CACHE_NO_DATA	0xFF  // length of an entry not received yet
+#define CACHE_AGE_NONE	0xFFFF  // age shown for an entry not received yet
+#define CACHE_AGE_MAX	0xC000  // ages saturate here (7.3 minutes), before the coarse time base wraps
+
+typedef struct
+{
+	uint8_t header[3];  // frame header, the key
+	uint8_t data[CACHE_DATA_MAX];  // data bytes of the last frame
+	uint8_t len;  // number of data bytes, CACHE_NO_DATA = not received yet
+	uint16_t time;  // time_base_coarse() of the last update
+} cache_entry_t;
+
+cache_entry_t cache_entry[CACHE_ENTRIES];
+uint8_t cache_entries;  // number of entries in use, entries are kept in order of registration
+
+// signal extraction, fields of frames with a registered header, streamed when their value changes
+#define SIGNAL_ENTRIES	(4 * MCU_SRAM_SCALE)  // number of signals, the signal number is the table index
+#define SIGNAL_BITS_MAX	32  // field length plus shift
+#define SIGNAL_LE		0x80  // length flag, field bytes lowest first
+#define SIGNAL_VALID	0x01  // value received
+#define SIGNAL_SENT		0x02  // value sent since the stream was started
+
+typedef struct
+{
+	uint8_t header[3];  // frame header to match
+	uint8_t offset;  // first field byte, 0 = first data byte after the header
+	uint8_t len;  // field length in bits, SIGNAL_LE = little endian
+	uint8_t shift;  // bits below the field, counted from the lowest bit of the field bytes
+	uint8_t state;  // SIGNAL_VALID, SIGNAL_SENT
+	uint32_t value;  // last received value
+} signal_entry_t;
+
+signal_entry_t signal_entry[SIGNAL_ENTRIES];
+uint8_t signal_entries;  // number of entries in use
+bool signal_stream;  // send changed values
+
+// response cache, last positive response of a repeated request while it is fresh
+#ifndef RESP_CACHE_ENTRIES
+#define RESP_CACHE_ENTRIES	((MCU_SRAM_SCALE > 1) ? 4 : 1)  // number of requests
+#endif
+#define RESP_CACHE_REQ_MAX	11  // 3 header and 8 data bytes, CRC not kept, the key
+#define RESP_CACHE_RESP_MAX	12  // SAE frame length with CRC, longer responses are not cached
+
+typedef struct
+{
+	uint8_t req[RESP_CACHE_REQ_MAX];  // request frame without CRC
+	uint8_t req_len;  // 0 = entry free
+	uint8_t recv_addr;  // receive address the response was taken for, part of the key
+	uint8_t resp[RESP_CACHE_RESP_MAX];  // response frame with CRC
+	uint8_t resp_len;
+	uint16_t time;  // time_base_coarse() when the response was received
+} resp_cache_entry_t;
+
+resp_cache_entry_t resp_cache_entry[RESP_CACHE_ENTRIES];
+uint8_t resp_cache_ttl;  // time to live in seconds, 0 = cache off
+
+// trigger capture, frames around a trigger frame are kept in a circular buffer
+#define CAPTURE_SLOTS	((MCU_SRAM_SCALE > 1) ? 32 : 8)  // frames in the capture buffer, must be a power of 2
+
+#define CAPTURE_OFF			0 // not recording
+#define CAPTURE_ARMED		1 // recording pre-trigger history, waiting for the trigger frame
+#define CAPTURE_TRIGGERED	2 // recording post-trigger frames
+#define CAPTURE_DONE		3 // buffer frozen, waiting for dump
+
+#define is_capturing() ((capture_state == CAPTURE_ARMED) || (capture_state == CAPTURE_TRIGGERED))
+
+const char capture_state_txt[][11] PROGMEM = { "OFF ", "ARMED ", "TRIGGERED ", "DONE " };
+
+uint8_t capture_slot[CAPTURE_SLOTS];  // frame pool slot per position, FRAME_NONE = empty
+uint8_t capture_head;  // next position to write
+uint8_t capture_count;  // frames kept, oldest at capture_head - capture_count
+uint8_t capture_pre;  // pre-trigger frames to keep
+uint8_t capture_post;  // post-trigger frames still to record
+uint8_t capture_trig;  // position of the trigger frame
+uint8_t capture_state;
+uint8_t capture_match[FRAME_MATCH_LEN];  // trigger frame pattern
+uint8_t capture_mask[FRAME_MATCH_LEN];  // bits to compare, 0 = don't care
+
+// raw pulse capture stream, one byte per pulse in PULSE_TICK_NS ticks (1.085us @ 7,3728MHz)
+#define PULSE_SHORT_MAX	0xFC // longest pulse sent as a single byte
+#define PULSE_END		0xFD // end of capture, STOPPED text follows
+#define PULSE_LOST		0xFE // followed by the number of pulses lost on a full Tx ring buffer
+#define PULSE_LONG		0xFF // followed by a 16 bit width, high byte first, 0xFFFF = 65535 ticks (71ms) or more
+
+// statistics text, one per 16 bit counter in stats_t order
+#define STATS_COUNTERS	10
+
+const char stats_txt[STATS_COUNTERS][15] PROGMEM = {
+	"RX FRAMES ", "TX FRAMES ", "CRC ERRORS ", "SOF ERRORS ",
+	"PULSE ERRORS ", "TX ERRORS ", "UART OVERRUNS ", "OUTPUT DROPS ",
+	"GLITCHES ", "GLITCH SAVES "
+};
+
+// response latency histograms, EOF of our request to SOF of the response
+// buckets in Timer0 ticks (34.72us): < 16, then doubling up to >= 2048 (71ms)
+#define LATENCY_TARGETS	((MCU_SRAM_SCALE > 1) ? 4 : 1)  // receive addresses with own histogram
+#define LATENCY_BUCKETS	9
+
+typedef struct
+{
+	uint8_t addr;  // receive address
+	bool used;
+	uint16_t count[LATENCY_BUCKETS];  // transactions per bucket
+	uint16_t max;  // longest latency in Timer0 ticks
+} latency_hist_t;
+
+latency_hist_t latency_hist[LATENCY_TARGETS];
+
+// SRAM instrumentation, free SRAM is painted at startup, frame buffers end with guard bytes
+#define STACK_CANARY	0xC5  // paint pattern between end of data and stack
+#define FRAME_GUARD		0xA5  // guard byte pattern
+#define FRAME_GUARD_LEN	4
+
+// frame buffer pool, every J1850 frame lives in a slot handed over by its number
+#define FRAME_SLOT_LEN		RX_BUFFER_MAX_LEN  // bytes per slot including CRC, receive and AT SD are bounded by it
+#define FRAME_WORK_SLOTS	3  // request, background receive and ECU response, nested at most this deep
+#define FRAME_SLOTS			(CAPTURE_SLOTS + FRAME_WORK_SLOTS)
+#define FRAME_NONE			0xFF  // no slot
+#define FRAME_FREE			0xFF  // length of a free slot
+
+typedef struct
+{
+	uint8_t len;  // frame length including CRC, FRAME_FREE = slot free, in front so an overrun of data cannot reach it
+	uint8_t data[FRAME_SLOT_LEN];  // J1850 frame
+	uint8_t guard[FRAME_GUARD_LEN];  // FRAME_GUARD right after data, overwritten by an overrun
+} frame_buf_t;
+
+frame_buf_t frame_pool[FRAME_SLOTS];
+uint8_t frame_request;  // slot of serial_processing(), request and its response
+
+#define frame_data(slot)	(frame_pool[slot].data)
+
+uint16_t frame_guard_hits;  // frame buffer overruns detected
+
+extern uint8_t _end;  // linker symbol, end of data and bss
+extern uint8_t __stack;  // linker symbol, top of stack
+
+// configuration kept in EEPROM, loaded at boot
+#define CONFIG_VERSION	3  // change with any layout change of config_t
+
+typedef struct
+{
+	uint8_t version;  // CONFIG_VERSION, 0xFF = erased or cleared
+	uint16_t parameter_bits;  // without monitor modes
+	uint8_t format_bits;
+	uint8_t req_header[3];
+	uint8_t auto_recv_addr;
+	uint8_t timeout_multiplier;
+	uint8_t mon_receiver;
+	uint8_t mon_transmitter;
+	char baud;  // ASCII digit of baud rate, see AT Bx
+	uint8_t resp_cache_ttl;
+	uint8_t crc;  // J1850 CRC of all bytes above
+} config_t;
+
+config_t config_eeprom EEMEM;
+
+// define flow control state bit mask constants
+#define FLOW_RX_STOP	0x01 // bit 0 : host is throttled, our Rx ring buffer is filling up
+#define FLOW_TX_STOP	0x02 // bit 1 : host sent XOFF, hold our output
 
 // use of bit-mask for parameters init to default values
 volatile uint16_t parameter_bits = HEADER|RESPONSE|AUTO_RECV;
 //volatile uint16_t parameter_bits = HEADER|LINEFEED|RESPONSE|AUTO_RECV;
+uint8_t format_bits = SPACES|PROMPT;
 
 uint8_t j1850_req_header[3] = {0x68, 0x6A, 0xF1};  // default request header
 uint8_t auto_recv_addr = 0x6B;  // physical or functional address in receive mode
 uint8_t mon_receiver;  // monitor receiver only addr
 uint8_t mon_transmitter;  // monitor transmitter only addr
 
-uint8_t serial_msg_buf[SERIAL_MSG_BUF_SIZE];	 // serial Rx buffer
+uint8_t serial_msg_buf[SERIAL_MSG_BUF_SIZE];	 // serial command line buffer
 uint8_t *serial_msg_pntr;
+bool serial_msg_overrun;  // command line did not fit into serial_msg_buf
+
+volatile uint8_t serial_rx_ring[SERIAL_RX_RING_SIZE];  // serial Rx buffer
+volatile uint8_t serial_rx_head;  // written by Rx interrupt
+volatile uint8_t serial_rx_tail;  // read by main loop
+volatile uint8_t serial_tx_ring[SERIAL_TX_RING_SIZE];  // serial Tx buffer
+volatile uint8_t serial_tx_head;  // written by main loop
+volatile uint8_t serial_tx_tail;  // read by UDRE interrupt
+volatile uint8_t serial_flow;  // flow control state bits
+volatile uint8_t serial_flow_char;  // XON/XOFF waiting for the transmitter, 0 = none
+char serial_baud;  // ASCII digit of the current baud rate, see AT Bx, 0 = default
+
+// SRAM budget, data and bss must leave MCU_STACK_RESERVE bytes for the stack (the
+// makefile gives the linker the same limit). SRAM_TABLES are the buffers and tables
+// above, SRAM_SCALARS covers the single variables, add new tables here.
+#define MCU_STACK_RESERVE	256
+#define SRAM_SCALARS		64
+
+#if J1850_CHANNELS > 1
+#define SRAM_GATEWAY	sizeof(gateway_entry)
+#else
+#define SRAM_GATEWAY	0
+#endif
+
+#define SRAM_TABLES	(sizeof(frame_pool) + sizeof(serial_msg_buf) + sizeof(serial_rx_ring) + \
+					 sizeof(serial_tx_ring) + sizeof(pipe_slot) + sizeof(ecu_entry) + SRAM_GATEWAY + \
+					 sizeof(cache_entry) + sizeof(signal_entry) + sizeof(resp_cache_entry) + \
+					 sizeof(capture_slot) + sizeof(latency_hist) + sizeof(rx_timing) + sizeof(stats))
 
 int16_t serial_putc(int8_t data);	// send one databyte to USART
+bool serial_try_putc(uint8_t data);
 void serial_put_byte2ascii(uint8_t val);
+void serial_put_frame2ascii(uint8_t *data, int8_t nbytes);
 void serial_puts_P(const char *s);
 int8_t serial_processing(void);
+void serial_poll(void);
+void serial_flow_stop(void);
+void serial_flow_go(void);
+void monitor_output(uint8_t *msg_buf, int8_t nbytes, uint8_t tag);
+bool monitor_filter(uint8_t *msg_buf);
+void bus_poll(void);
+void frame_dispatch(uint8_t *msg_buf, int8_t nbytes);
+bool pipeline_busy(uint8_t addr);
+int8_t pipeline_add(uint8_t addr, uint8_t sid, uint16_t eof_time);
+void pipeline_output(uint8_t tag);
+bool pipeline_match(uint8_t *msg_buf, int8_t nbytes);
+void pipeline_tick(void);
+int8_t ecu_respond(uint8_t *msg_buf, int8_t nbytes, uint8_t *resp_buf);
+void gateway_forward(uint8_t *msg_buf, int8_t nbytes);
+void cache_update(uint8_t *msg_buf, int8_t nbytes);
+void signal_update(uint8_t *msg_buf, int8_t nbytes);
+void resp_cache_expire(void);
+void cache_age_limit(void);
+bool frame_match(uint8_t *msg_buf, int8_t nbytes, uint8_t *match, uint8_t *mask);
+void capture_frame(uint8_t slot);
+uint8_t capture_take(uint8_t slot, int8_t nbytes);
+void capture_clear(void);
+void pulse_capture(void);
+void stats_output(bool binary);
+void latency_add(uint8_t addr, uint16_t ticks);
+void latency_output(void);
+void rx_timing_output(void);
+void stack_paint(void) __attribute__((naked, used, section(".init1")));
+uint16_t stack_free_min(void);
+void frame_pool_init(void);
+uint8_t frame_alloc(void);
+void frame_release(uint8_t slot);
+void frame_guard_check(uint8_t slot);
+bool config_load(bool with_baud);
 void ident(void);
 void print_prompt(void);
 
-#define DEFAULT_BAUD   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)BAUD_RATE*16)-1))	// calculate baud rate value for UBBR
+// UBRR value rounded to the nearest rate, divider 16 or 8 (U2X), no casts so it also works in #if
+#define BAUD_UBRR(rate, div)   ((MCU_XTAL + 1UL*(rate)*(div)/2) / (1UL*(rate)*(div)) - 1)
+#define BAUD_REAL(rate, div)   (MCU_XTAL / (1UL*(div)*(BAUD_UBRR(rate, div)+1)))
+#define BAUD_ERROR(rate, div)  ((BAUD_REAL(rate, div) > (rate) ? BAUD_REAL(rate, div)-(rate) : (rate)-BAUD_REAL(rate, div)) * 1000UL / (rate))
+#define BAUD_ERROR_MAX   20  // 2.0% maximum baud rate error, in 1/1000
+#define BAUD_VALID(rate, div)  (MCU_XTAL >= 1UL*(rate)*(div) && BAUD_ERROR(rate, div) <= BAUD_ERROR_MAX)
+
+#define DEFAULT_BAUD   ((unsigned int)BAUD_UBRR(BAUD_RATE, 16))	// calculate baud rate value for UBBR
+
+#define BAUD_9600   ((unsigned int)BAUD_UBRR(9600, 16))
+#define BAUD_14400   ((unsigned int)BAUD_UBRR(14400, 16))
+#define BAUD_19200   ((unsigned int)BAUD_UBRR(19200, 16))
+#define BAUD_28800   ((unsigned int)BAUD_UBRR(28800, 16))
+#define BAUD_38400   ((unsigned int)BAUD_UBRR(38400, 16))
+#define BAUD_57600   ((unsigned int)BAUD_UBRR(57600, 16))
+
+// double speed (U2X) rates, exact with a 7.3728MHz crystal
+#define BAUD_230400_U2X   ((unsigned int)BAUD_UBRR(230400, 8))
+#define BAUD_460800_U2X   ((unsigned int)BAUD_UBRR(460800, 8))
+
+// AT Bx rates usable with MCU_XTAL, bit x set for rate x, 8 and 9 select the default rate
+#define BAUD_RATES_VALID ( (BAUD_VALID(9600, 16) << 0) | (BAUD_VALID(14400, 16) << 1) \
+                         | (BAUD_VALID(19200, 16) << 2) | (BAUD_VALID(28800, 16) << 3) \
+                         | (BAUD_VALID(38400, 16) << 4) | (BAUD_VALID(57600, 16) << 5) \
+                         | (BAUD_VALID(230400, 8) << 6) | (BAUD_VALID(460800, 8) << 7) | 0x0300 )
 
-#define BAUD_9600   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)9600*16)-1))
-#define BAUD_14400   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)14400*16)-1))
-#define BAUD_19200   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)19200*16)-1))
-#define BAUD_28800   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)28800*16)-1))
-#define BAUD_38400   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)38400*16)-1))
-#define BAUD_57600   ((unsigned int)((unsigned long)MCU_XTAL/((unsigned long)57600*16)-1))
+#define BAUD_SWITCH_TIMEOUT	75	// ms to wait for host confirmation on negotiated baud rate switch
 
 #endif // __MAIN_H__
@@ -0,0 +1,104 @@
+/*************************************************************************
+**  AVR J1850 VPW Interface
+**
+**  by Michael Wolf
+**  contact: webmaster@mictronics.de
+**  homepage: www.mictronics.de
+**
+**  Modified by Remi Serriere
+**  GitHub: https://github.com/remiserriere/AVR-J1850-VPW
+**
+**  Released under GNU GENERAL PUBLIC LICENSE
+**
+**  Revision History
+**
+**  when         what  who			why
+**  19/10/26     v1.10 Remi S   Initial release, register names and interrupt vectors per MCU
+**
+**  The code uses the ATmega8 register names. Other MCUs map their USART
+**  registers onto them here, Timer0/Timer1 registers which moved apart on
+**  newer parts go through the TIMERx_ names, interrupt vectors through the
+**  VECTOR_ names. MCU_SRAM_SIZE lets main.h scale its buffers.
+**
+**  ATmega8     1K SRAM, reference
+**  ATmega32    2K SRAM, same registers, JTAG disabled at boot (PC2..PC5)
+**  ATmega328P  2K SRAM, USART0 and split timer flag registers
+**
+**************************************************************************/
+
+#ifndef __MCU_H__
+#define __MCU_H__
+
+#if defined(__AVR_ATmega8__) || defined(__AVR_ATmega32__)
+
+#define USART_8N1	(_BV(URSEL)|_BV(UCSZ1)|_BV(UCSZ0))  // UCSRC shares its address with UBRRH
+
+#define TIMER0_TCCR		TCCR0
+#define TIMER0_TIMSK	TIMSK
+#define TIMER0_TIFR		TIFR
+#define TIMER1_TIFR		TIFR
+
+#if defined(__AVR_ATmega32__)
+#define MCU_SRAM_SIZE	2048
+
+#define VECTOR_TIMER0_OVF	_VECTOR(11)
+#define VECTOR_USART_RXC	_VECTOR(13)
+#define VECTOR_USART_UDRE	_VECTOR(14)
+
+// JTAG pins are on PORTC, JTD must be written twice within four cycles
+#define mcu_init() do { MCUCSR = _BV(JTD); MCUCSR = _BV(JTD); wdt_disable(); } while(0)
+#else
+#define MCU_SRAM_SIZE	1024
+
+#define VECTOR_TIMER0_OVF	_VECTOR(9)
+#define VECTOR_USART_RXC	_VECTOR(11)
+#define VECTOR_USART_UDRE	_VECTOR(12)
+
+#define mcu_init() wdt_disable()
+#endif
+
+#elif defined(__AVR_ATmega328P__)
+
+#define MCU_SRAM_SIZE	2048
+
+#define UBRRH	UBRR0H
+#define UBRRL	UBRR0L
+#define UCSRA	UCSR0A
+#define UCSRB	UCSR0B
+#define UCSRC	UCSR0C
+#define UDR		UDR0
+#define RXCIE	RXCIE0
+#define RXEN	RXEN0
+#define TXEN	TXEN0
+#define UDRIE	UDRIE0
+#define UDRE	UDRE0
+#define TXC		TXC0
+#define U2X		U2X0
+#define DOR		DOR0
+
+#define USART_8N1	(_BV(UCSZ01)|_BV(UCSZ00))
+
+#define TIMER0_TCCR		TCCR0B
+#define TIMER0_TIMSK	TIMSK0
+#define TIMER0_TIFR		TIFR0
+#define TIMER1_TIFR		TIFR1
+
+#define VECTOR_TIMER0_OVF	_VECTOR(16)
+#define VECTOR_USART_RXC	_VECTOR(18)
+#define VECTOR_USART_UDRE	_VECTOR(19)
+
+// a watchdog reset leaves WDRF set, which keeps the watchdog enabled
+#define mcu_init() do { MCUSR &= ~_BV(WDRF); wdt_disable(); } while(0)
+
+#else
+#error "MCU not supported, see mcu.h"
+#endif
+
+// buffer size factor for main.h
+#if MCU_SRAM_SIZE >= 2048
+#define MCU_SRAM_SCALE	2
+#else
+#define MCU_SRAM_SCALE	1
+#endif
+
+#endif // __MCU_H__